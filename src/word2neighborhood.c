@@ -19,12 +19,85 @@
 //  technology, or source libraries
 //  -----------------------------------------------------------------------
 
+#if defined(__linux__)&&!defined(_GNU_SOURCE)
+ #define _GNU_SOURCE // fopencookie (corpus_reader)
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
-#include <io.h>
+#include <wctype.h>
+
+#if defined(_WIN32)
+ #include <io.h>
+ #include <windows.h>
+ #include <process.h>
+ #include <psapi.h>
+ #if defined(_MSC_VER)
+  #pragma comment(lib,"psapi.lib")
+ #endif
+#else
+ #include <sys/resource.h>
+ #include <pthread.h>
+ #include <unistd.h>
+ #include <fcntl.h>
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+#endif
+
+#if !defined(_WIN32)
+ #include <time.h>
+ #include <signal.h>
+ #include <strings.h>
+ #define _strcmpi strcasecmp
+#else
+ #include <fcntl.h>
+#endif
+
+// MSVC headers have them, other compilers don't
+#if !defined(min)
+ #define min(a,b) (((a)<(b))?(a):(b))
+#endif
+#if !defined(max)
+ #define max(a,b) (((a)>(b))?(a):(b))
+#endif
+
+#include "word2neighborhood.h"
+
+#if defined(W2N_ZLIB)
+ #include <zlib.h>
+#endif
+#if defined(W2N_ZSTD)
+ #include <zstd.h>
+#endif
+
+#if defined(W2N_STATS)&&(defined(__x86_64__)||defined(__i386__)||defined(_M_X64)||defined(_M_IX86))
+ #if defined(_MSC_VER)
+  #include <intrin.h>
+ #else
+  #include <x86intrin.h>
+ #endif
+ #define W2N_RDTSC
+#endif
+
+#if defined(__AVX__)
+ #include <immintrin.h>
+ #define W2N_AVX
+#endif
+#if defined(__AVX2__)
+ #include <immintrin.h>
+ #define W2N_AVX2
+#endif
+#if defined(__SSE2__)||defined(_M_X64)||(defined(_M_IX86_FP)&&(_M_IX86_FP>=2))
+ #include <emmintrin.h>
+ #define W2N_SSE2
+#endif
+#if defined(__SSSE3__)||defined(__AVX__)
+ #include <tmmintrin.h>
+ #define W2N_SSSE3
+#endif
 
 // --------------------------------------------------------------------
 
@@ -40,6 +113,358 @@
 
 size_t max_word_len=60;
 
+// --------------------------------------------------------------------
+//
+// timer_now
+// monotonic clock, in seconds
+//
+// --------------------------------------------------------------------
+
+double timer_now(void)
+{
+#if defined(_WIN32)
+ LARGE_INTEGER freq,now;
+ QueryPerformanceFrequency(&freq);
+ QueryPerformanceCounter(&now);
+ return (double)now.QuadPart/(double)freq.QuadPart;
+#else
+ struct timespec ts;
+ clock_gettime(CLOCK_MONOTONIC,&ts);
+ return (double)ts.tv_sec+(double)ts.tv_nsec/1e9;
+#endif
+}
+
+// --------------------------------------------------------------------
+//
+// run_stats
+// what a build run did: corpus bytes/tokens/docs, peak RSS and - in
+// instrumented builds (-DW2N_STATS) - per phase timers and hashquads
+// probe length histogram, all dumped as json with -stats
+//
+// stats_timer(t)          declares and starts a timer
+// stats_elapsed(field,t)  adds timer ticks to w2n_stats.field
+// stats_count(field,n)    adds n to w2n_stats.field
+//
+// --------------------------------------------------------------------
+
+typedef struct {
+ double             time0;
+ unsigned long long tick0;
+ unsigned long long bytes,tokens,docs,pairs;
+ unsigned long long tokenize,lookup,addcorpus,reduce,readonly,write;
+ unsigned long long probes[18],rehashes,reductions;
+}run_stats;
+
+run_stats w2n_stats;
+
+unsigned long long stats_ticks(void)
+{
+#if defined(W2N_RDTSC)
+ return __rdtsc();
+#else
+ return (unsigned long long)(timer_now()*1e9);
+#endif
+}
+
+void stats_reset(void)
+{
+ memset(&w2n_stats,0,sizeof(w2n_stats));
+ w2n_stats.time0=timer_now();
+ w2n_stats.tick0=stats_ticks();
+}
+
+#if defined(W2N_STATS)
+ #define stats_timer(t)          unsigned long long t=stats_ticks()
+ #define stats_elapsed(field,t)  (w2n_stats.field+=stats_ticks()-(t))
+ #define stats_count(field,n)    (w2n_stats.field+=(n))
+#else
+ #define stats_timer(t)
+ #define stats_elapsed(field,t)
+ #define stats_count(field,n)
+#endif
+
+size_t process_peakrss(void)
+{
+#if defined(_WIN32)
+ PROCESS_MEMORY_COUNTERS pmc;
+ if(GetProcessMemoryInfo(GetCurrentProcess(),&pmc,sizeof(pmc)))
+  return pmc.PeakWorkingSetSize;
+ return 0;
+#else
+ struct rusage ru;
+ if(getrusage(RUSAGE_SELF,&ru)==0)
+#if defined(__APPLE__)
+  return (size_t)ru.ru_maxrss;
+#else
+  return (size_t)ru.ru_maxrss*1024;
+#endif
+ return 0;
+#endif
+}
+
+// --------------------------------------------------------------------
+//
+// allocation counters (benchmark builds only, -DW2N_BENCHMARK)
+//
+// --------------------------------------------------------------------
+
+#if defined(W2N_BENCHMARK)
+size_t bench_allocs=0,bench_allocbytes=0;
+
+static void*bench_malloc(size_t size)
+{
+ bench_allocs++;bench_allocbytes+=size;
+ return malloc(size);
+}
+
+static void*bench_calloc(size_t num,size_t size)
+{
+ bench_allocs++;bench_allocbytes+=num*size;
+ return calloc(num,size);
+}
+
+static void*bench_realloc(void*p,size_t size)
+{
+ bench_allocs++;bench_allocbytes+=size;
+ return realloc(p,size);
+}
+
+#define malloc(size)      bench_malloc(size)
+#define calloc(num,size)  bench_calloc(num,size)
+#define realloc(p,size)   bench_realloc(p,size)
+#endif
+
+// --------------------------------------------------------------------
+//
+// threads
+// just what's needed to split a job over a few worker threads
+//
+// void thread_start(w2n_thread*t,thread_entry entry,void*arg)
+// void thread_join(w2n_thread*t)
+//
+// void parallel_run(int threads,parallel_job job,void*ctx)
+//  runs job(ctx,thread,threads) on <threads> threads (the first one
+//  being the calling thread) and waits for all of them
+//
+// --------------------------------------------------------------------
+
+#if defined(_WIN32)
+typedef HANDLE    w2n_thread;
+#else
+typedef pthread_t w2n_thread;
+#endif
+
+typedef void (*thread_entry)(void*arg);
+typedef void (*parallel_job)(void*ctx,int thread,int threads);
+
+typedef struct {
+ thread_entry entry;
+ void        *arg;
+}thread_start_info;
+
+#if defined(_WIN32)
+static unsigned __stdcall thread_proc(void*p)
+#else
+static void*thread_proc(void*p)
+#endif
+{
+ thread_start_info info=*(thread_start_info*)p;
+ free(p);
+ info.entry(info.arg);
+ return 0;
+}
+
+int thread_start(w2n_thread*t,thread_entry entry,void*arg)
+{
+ thread_start_info*info=(thread_start_info*)malloc(sizeof(thread_start_info));
+ if(info==NULL)
+  return 0;
+ info->entry=entry;
+ info->arg=arg;
+#if defined(_WIN32)
+ *t=(HANDLE)_beginthreadex(NULL,0,thread_proc,info,0,NULL);
+ if(*t==0)
+  {free(info);return 0;}
+#else
+ if(pthread_create(t,NULL,thread_proc,info)!=0)
+  {free(info);return 0;}
+#endif
+ return 1;
+}
+
+void thread_join(w2n_thread*t)
+{
+#if defined(_WIN32)
+ WaitForSingleObject(*t,INFINITE);
+ CloseHandle(*t);
+#else
+ pthread_join(*t,NULL);
+#endif
+}
+
+int thread_cpus(void)
+{
+#if defined(_WIN32)
+ SYSTEM_INFO si;
+ GetSystemInfo(&si);
+ return max(1,(int)si.dwNumberOfProcessors);
+#else
+ long n=sysconf(_SC_NPROCESSORS_ONLN);
+ return (n>0)?(int)n:1;
+#endif
+}
+
+typedef struct {
+ parallel_job job;
+ void        *ctx;
+ int          thread,threads;
+}parallel_task;
+
+static void parallel_entry(void*arg)
+{
+ parallel_task*t=(parallel_task*)arg;
+ t->job(t->ctx,t->thread,t->threads);
+}
+
+void parallel_run(int threads,parallel_job job,void*ctx)
+{
+ parallel_task*tasks;
+ w2n_thread   *th;
+ int          *started,i;
+ if(threads<=1)
+  {job(ctx,0,1);return;}
+ tasks=(parallel_task*)calloc(threads,sizeof(parallel_task));
+ th=(w2n_thread*)calloc(threads,sizeof(w2n_thread));
+ started=(int*)calloc(threads,sizeof(int));
+ if((tasks==NULL)||(th==NULL)||(started==NULL))
+  {
+   free(tasks);free(th);free(started);
+   job(ctx,0,1);
+   return;
+  }
+ for(i=0;i<threads;i++)
+  {
+   tasks[i].job=job;
+   tasks[i].ctx=ctx;
+   tasks[i].thread=i;
+   tasks[i].threads=threads;
+  }
+ for(i=1;i<threads;i++)
+  started[i]=thread_start(&th[i],parallel_entry,&tasks[i]);
+ job(ctx,0,threads);
+ for(i=1;i<threads;i++)
+  if(started[i])
+   thread_join(&th[i]);
+  else
+   job(ctx,i,threads);
+ free(started);
+ free(th);
+ free(tasks);
+}
+
+// --------------------------------------------------------------------
+//
+// mapped_file
+// read only memory mapping of a whole file
+//
+// --------------------------------------------------------------------
+
+typedef struct {
+ const unsigned char*data;
+ size_t              size;
+#if defined(_WIN32)
+ HANDLE              file,mapping;
+#endif
+}mapped_file;
+
+int mapped_file_open(mapped_file*m,const char*fn)
+{
+ memset(m,0,sizeof(*m));
+#if defined(_WIN32)
+ {
+  LARGE_INTEGER size;
+  m->file=CreateFileA(fn,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
+  if(m->file==INVALID_HANDLE_VALUE)
+   return 0;
+  if(!GetFileSizeEx(m->file,&size)||(size.QuadPart==0))
+   {CloseHandle(m->file);return 0;}
+  m->size=(size_t)size.QuadPart;
+  m->mapping=CreateFileMappingA(m->file,NULL,PAGE_READONLY,0,0,NULL);
+  if(m->mapping)
+   m->data=(const unsigned char*)MapViewOfFile(m->mapping,FILE_MAP_READ,0,0,0);
+  if(m->data==NULL)
+   {
+    if(m->mapping) CloseHandle(m->mapping);
+    CloseHandle(m->file);
+    return 0;
+   }
+ }
+#else
+ {
+  struct stat st;
+  void       *data;
+  int         fd=open(fn,O_RDONLY);
+  if(fd==-1)
+   return 0;
+  if((fstat(fd,&st)!=0)||(st.st_size==0))
+   {close(fd);return 0;}
+  m->size=(size_t)st.st_size;
+  data=mmap(NULL,m->size,PROT_READ,MAP_SHARED,fd,0);
+  close(fd);
+  if(data==MAP_FAILED)
+   return 0;
+  m->data=(const unsigned char*)data;
+ }
+#endif
+ return 1;
+}
+
+void mapped_file_close(mapped_file*m)
+{
+ if(m->data)
+  {
+#if defined(_WIN32)
+   UnmapViewOfFile(m->data);
+   CloseHandle(m->mapping);
+   CloseHandle(m->file);
+#else
+   munmap((void*)m->data,m->size);
+#endif
+  }
+ memset(m,0,sizeof(*m));
+}
+
+long long file_tell(FILE*f)
+{
+#if defined(_WIN32)
+ return _ftelli64(f);
+#else
+ return (long long)ftello(f);
+#endif
+}
+
+int file_seek(FILE*f,long long offset)
+{
+#if defined(_WIN32)
+ return _fseeki64(f,offset,SEEK_SET);
+#else
+ return fseeko(f,(off_t)offset,SEEK_SET);
+#endif
+}
+
+// file size (current position is lost)
+long long file_size(FILE*f)
+{
+#if defined(_WIN32)
+ if(_fseeki64(f,0,SEEK_END)==0)
+#else
+ if(fseeko(f,0,SEEK_END)==0)
+#endif
+  return file_tell(f);
+ else
+  return -1;
+}
+
 // --------------------------------------------------------------------
 //
 // String Dictionary implementation (add&search only)
@@ -57,8 +482,19 @@ size_t max_word_len=60;
 // string in the dictionary (we don't want to do that, we're going to 
 // prune dictionary just at the end of the insertion task - using td-idf)
 //
+// Chunks start at 64 KB and double up to 64 MB (bigger requests get a
+// chunk of their own), memory is not zeroed. With memorybag_hugepages
+// set (-hugepages) chunks of 2 MB or more are 2 MB aligned and marked
+// for transparent huge pages where the system has them.
+//
 // --------------------------------------------------------------------
 
+#define memorybag_firstchunk (64*1024)
+#define memorybag_maxchunk   (64*1024*1024)
+#define memorybag_hugepage   (2*1024*1024)
+
+static int memorybag_hugepages;
+
 typedef struct {
  unsigned char *items;
  size_t         num,size; 
@@ -69,6 +505,22 @@ typedef struct {
  size_t        num,size; 
 }memorybag;
 
+static unsigned char*memorybag_chunk(size_t size)
+{
+#if defined(MADV_HUGEPAGE)
+ if(memorybag_hugepages&&(size>=memorybag_hugepage))
+  {
+   void*m=NULL;
+   if(posix_memalign(&m,memorybag_hugepage,size)==0)
+    {
+     madvise(m,size,MADV_HUGEPAGE);
+     return (unsigned char*)m;
+    }
+  }
+#endif
+ return (unsigned char*)malloc(size);
+}
+
 void memorybag_new(memorybag*mem)
 {
  memset(mem,0,sizeof(*mem));
@@ -76,37 +528,73 @@ void memorybag_new(memorybag*mem)
  mem->items=(membag*)calloc(mem->size,sizeof(mem->items[0]));
  if(mem->items)
   {
-   mem->items[mem->num].size=64*1024; 
-   mem->items[mem->num].items=(unsigned char*)calloc(mem->items[mem->num].size,sizeof(unsigned char));
+   mem->items[mem->num].size=memorybag_firstchunk; 
+   mem->items[mem->num].items=memorybag_chunk(mem->items[mem->num].size);
   }
 }
 
 void memorybag_delete(memorybag*mem)
 {
- unsigned int i;
- for(i=0;i<mem->num;i++)
-  if(mem->items[i].items)
-   free(mem->items[i].items);
+ size_t i;
+ if(mem->items)
+  {
+   for(i=0;i<=mem->num;i++)
+    if(mem->items[i].items)
+     free(mem->items[i].items);
+   free(mem->items);
+  }
+ memset(mem,0,sizeof(*mem));
 }
 
-void*memorybag_alloc(memorybag*mem,unsigned int size)
+// align must be a power of 2 (1 for strings)
+void*memorybag_allocex(memorybag*mem,size_t size,size_t align)
 {
- void*m;
- if(mem->items[mem->num].num+size>=mem->items[mem->num].size)
+ membag*b=&mem->items[mem->num];
+ size_t at=(((size_t)b->items+b->num+align-1)&~(align-1))-(size_t)b->items;
+ if((b->items==NULL)||(at+size>b->size))
   {
-   mem->num++;
-   if(mem->num>=mem->size)
+   size_t chunk=min(max(b->size*2,(size_t)memorybag_firstchunk),(size_t)memorybag_maxchunk);
+   if(mem->num+1>=mem->size)
     {
-     mem->size+=16;
-     mem->items=(membag*)realloc(mem->items,mem->size*sizeof(membag));
+     membag*items=(membag*)realloc(mem->items,mem->size*2*sizeof(membag));
+     if(items==NULL)
+      return NULL;
+     memset(items+mem->size,0,mem->size*sizeof(membag));
+     mem->items=items;
+     mem->size*=2;
     } 
-   mem->items[mem->num].num=0;
-   mem->items[mem->num].size=64*1024; 
-   mem->items[mem->num].items=(unsigned char*)calloc(mem->items[mem->num].size,sizeof(unsigned char));   
+   if(chunk<size+align)
+    chunk=size+align;
+   b=&mem->items[++mem->num];
+   b->num=0;
+   b->size=chunk; 
+   b->items=memorybag_chunk(b->size);
+   if(b->items==NULL)
+    {
+     b->size=0;
+     return NULL;
+    }
+   at=(((size_t)b->items+align-1)&~(align-1))-(size_t)b->items;
   } 
- m=(void*)(mem->items[mem->num].items+mem->items[mem->num].num);
- mem->items[mem->num].num+=size;
- return m;
+ b->num=at+size;
+ return b->items+at;
+}
+
+void*memorybag_alloc(memorybag*mem,unsigned int size)
+{
+ return memorybag_allocex(mem,size,1);
+}
+
+void memorybag_bytes(memorybag*mem,size_t*used,size_t*reserved)
+{
+ size_t i;
+ *used=*reserved=0;
+ for(i=0;i<=mem->num;i++)
+  if(mem->items[i].items)
+   {
+    *used+=mem->items[i].num;
+    *reserved+=mem->items[i].size;
+   }
 }
 
 char*memorybag_strdup(memorybag*mem,const char*str)
@@ -117,6 +605,158 @@ char*memorybag_strdup(memorybag*mem,const char*str)
  return s; 
 }
 
+// --------------------------------------------------------------------
+//
+// varint
+// 7 bits per byte, high bit set on every byte but the last one
+//
+// --------------------------------------------------------------------
+
+static unsigned char*varint_put(unsigned char*p,unsigned int v)
+{
+ while(v>=0x80)
+  {
+   *p++=(unsigned char)(v|0x80);
+   v>>=7;
+  }
+ *p++=(unsigned char)v;
+ return p;
+}
+
+static const unsigned char*varint_get(const unsigned char*p,unsigned int*v)
+{
+ unsigned int r=0,shift=0;
+ while(*p&0x80)
+  {
+   r|=(unsigned int)(*p++&0x7F)<<shift;
+   shift+=7;
+  }
+ *v=r|((unsigned int)*p++<<shift);
+ return p;
+}
+
+// --------------------------------------------------------------------
+//
+// front_coded
+// read only string store, strings kept in id order in blocks of 16:
+// the first string of a block is stored as it is, the others as
+// varint(chars shared with the previous string) + rest of the string
+// (both zero terminated). When ids are in strcmp order lookups can
+// binary search the first strings of the blocks.
+//
+// --------------------------------------------------------------------
+
+#define front_coded_block 16
+
+typedef struct {
+ unsigned char *data;
+ size_t        *blocks;
+ size_t         num,bytes,maxlen;
+ int            sorted;
+}front_coded;
+
+int front_coded_new(front_coded*fc,const char**strs,size_t num)
+{
+ size_t i,size=0;
+ memset(fc,0,sizeof(*fc));
+ fc->num=num;
+ fc->sorted=1;
+ for(i=0;i<num;i++)
+  {
+   size_t len=strlen(strs[i]);
+   size+=len+6;
+   fc->maxlen=max(fc->maxlen,len);
+   if(i&&(strcmp(strs[i-1],strs[i])>=0))
+    fc->sorted=0;
+  }
+ fc->data=(unsigned char*)malloc(size+1);
+ fc->blocks=(size_t*)malloc((num/front_coded_block+2)*sizeof(size_t));
+ if((fc->data==NULL)||(fc->blocks==NULL))
+  {
+   free(fc->data);free(fc->blocks);
+   memset(fc,0,sizeof(*fc));
+   return 0;
+  }
+ for(i=0;i<num;i++)
+  {
+   unsigned char*p=fc->data+fc->bytes;
+   const char   *s=strs[i];
+   if((i%front_coded_block)==0)
+    fc->blocks[i/front_coded_block]=fc->bytes;
+   else
+    {
+     const char  *prev=strs[i-1];
+     unsigned int shared=0;
+     while(prev[shared]&&(prev[shared]==s[shared]))
+      shared++;
+     p=varint_put(p,shared);
+     s+=shared;
+    }
+   strcpy((char*)p,s);
+   p+=strlen(s)+1;
+   fc->bytes=p-fc->data;
+  }
+ fc->blocks[(num+front_coded_block-1)/front_coded_block]=fc->bytes;
+ // the copy was sized for the worst case
+ {
+  unsigned char*data=(unsigned char*)realloc(fc->data,fc->bytes+1);
+  if(data) fc->data=data;
+ }
+ return 1;
+}
+
+void front_coded_delete(front_coded*fc)
+{
+ free(fc->data);
+ free(fc->blocks);
+ memset(fc,0,sizeof(*fc));
+}
+
+// out must hold maxlen+1 chars
+const char*front_coded_get(front_coded*fc,size_t id,char*out)
+{
+ const unsigned char*p=fc->data+fc->blocks[id/front_coded_block];
+ size_t              k=id%front_coded_block,len=strlen((const char*)p);
+ memcpy(out,p,len+1);
+ p+=len+1;
+ while(k--)
+  {
+   unsigned int shared;
+   p=varint_get(p,&shared);
+   len=strlen((const char*)p);
+   memcpy(out+shared,p,len+1);
+   p+=len+1;
+  }
+ return out;
+}
+
+// id of str in a sorted store, -1 if missing (or store not sorted)
+long long front_coded_find(front_coded*fc,const char*str,char*out)
+{
+ size_t lo=0,hi=(fc->num+front_coded_block-1)/front_coded_block,id,last;
+ if(!fc->sorted)
+  return -1;
+ // last block whose first string is <= str
+ while(hi-lo>1)
+  {
+   size_t mid=(lo+hi)/2;
+   if(strcmp((const char*)fc->data+fc->blocks[mid],str)<=0)
+    lo=mid;
+   else
+    hi=mid;
+  }
+ last=min(fc->num,(lo+1)*front_coded_block);
+ for(id=lo*front_coded_block;id<last;id++)
+  {
+   int c=strcmp(front_coded_get(fc,id,out),str);
+   if(c==0)
+    return (long long)id;
+   if(c>0)
+    break;
+  }
+ return -1;
+}
+
 // --------------------------------------------------------------------
 //
 // tfidf_lemma & tfidf_dict
@@ -145,6 +785,10 @@ typedef struct {
  float      tfidf;
 }tfidf_lemma;
 
+// longest lemma + 1 (tfidf_dict_import line size): packed dictionaries
+// decode into caller buffers of this size
+#define tfidf_dict_maxstr 2048
+
 typedef struct {
  size_t       num,size;
  int          granularity;
@@ -157,6 +801,9 @@ typedef struct {
  
  int          docid;
  size_t       lemmas_cnt,docs_cnt;
+
+ // read only front coded strings (tfidf_dict_pack), items str are NULL
+ front_coded *packed;
 }tfidf_dict;
 
 #define DJB2
@@ -207,26 +854,59 @@ tfidf_dict*tfidf_dict_new(size_t size,int granularity,int useheap)
  return h;  
 }
 
+typedef struct {
+ tfidf_dict*dict;
+ size_t     maxcnt,maxdoccnt;
+}tfidf_job;
+
+static void tfidf_dict_settfidfrange(void*ctx,int thread,int threads)
+{
+ tfidf_job *j=(tfidf_job*)ctx;
+ tfidf_dict*dict=j->dict;
+ size_t     i,from=dict->num*thread/threads,to=dict->num*(thread+1)/threads;
+ for(i=from;i<to;i++)     
+  {
+   double tf=((double)dict->items[i].cnt/(double)j->maxcnt/*dict->lemmas_cnt*/);
+   double idf=((double)logf((double)j->maxdoccnt/*dict->docs_cnt*//(double)(1+dict->items[i].doccnt)));
+   dict->items[i].tfidf=(float)(tf*idf);
+  }     
+}
+
 void tfidf_dict_settfidf(tfidf_dict*dict)
 {
- size_t i,maxcnt=dict->items[0].cnt,maxdoccnt=dict->items[0].doccnt;
+ size_t    i;
+ tfidf_job j;
+ j.dict=dict;
+ j.maxcnt=dict->items[0].cnt;
+ j.maxdoccnt=dict->items[0].doccnt;
  for(i=1;i<dict->num;i++)
   {
-   if(dict->items[i].cnt>maxcnt)
-    maxcnt=dict->items[i].cnt;
-   if(dict->items[i].doccnt>maxdoccnt)
-    maxdoccnt=dict->items[i].doccnt; 
+   if(dict->items[i].cnt>j.maxcnt)
+    j.maxcnt=dict->items[i].cnt;
+   if(dict->items[i].doccnt>j.maxdoccnt)
+    j.maxdoccnt=dict->items[i].doccnt; 
   }  
- for(i=0;i<dict->num;i++)     
-  {
-   double tf=((double)dict->items[i].cnt/(double)maxcnt/*dict->lemmas_cnt*/);
-   double idf=((double)logf((double)maxdoccnt/*dict->docs_cnt*//(double)(1+dict->items[i].doccnt)));
-   dict->items[i].tfidf=(float)(tf*idf);
-  }     
+ parallel_run((dict->num<64*1024)?1:thread_cpus(),tfidf_dict_settfidfrange,&j);
+}
+
+// back to an empty dictionary (same allocated sizes)
+void tfidf_dict_reset(tfidf_dict*h)
+{
+ memset(h->hitems,0xFF,h->hsize*sizeof(h->hitems[0]));
+ memorybag_delete(&h->heap);
+ memorybag_new(&h->heap);
+ h->num=0;
+ h->docid=-1;
+ h->lemmas_cnt=h->docs_cnt=0;
 }
 
 void tfidf_dict_delete(tfidf_dict*h)
 {
+ if(h->packed)
+  {
+   front_coded_delete(h->packed);
+   free(h->packed);
+  }
  memorybag_delete(&h->heap);
  free(h->hitems);
  free(h->items);
@@ -238,10 +918,13 @@ int tfidf_dict_stringcompare(const void*a,const void*b)
  return strcmp(((tfidf_lemma*)a)->str,((tfidf_lemma*)b)->str);
 }
 
+// equal tfidf values are in string order: the order doesn't depend on the
+// one lemmas were met in, so merged and updated dictionaries get the ids
+// of a single run
 int tfidf_dict_tfidfcompare(const void*a,const void*b)
 {
  float dif=((tfidf_lemma*)b)->tfidf-((tfidf_lemma*)a)->tfidf;
- if(dif==0) return 0;
+ if(dif==0) return tfidf_dict_stringcompare(a,b);
  else
  if(dif>0)  return 1;
  else       return -1;
@@ -249,79 +932,418 @@ int tfidf_dict_tfidfcompare(const void*a,const void*b)
 
 typedef int (*tfidf_dict_compare)(const void*a,const void*b);
 
+// string of item i; packed dictionaries decode it into buf (tfidf_dict_maxstr
+// chars), plain ones return the item string
+const char*tfidf_dict_string(tfidf_dict*h,size_t i,char*buf)
+{
+ if(h->packed)
+  return front_coded_get(h->packed,i,buf);
+ else
+  return h->items[i].str;
+}
+
 void tfidf_dict_rehash(tfidf_dict*h)
 {
  size_t i;
+ char   buf[tfidf_dict_maxstr];
  memset(h->hitems,0xFF,h->hsize*sizeof(h->hitems[0]));
  for(i=0;i<h->num;i++)
   {
-   unsigned int hi=string_hashfunct(h->items[i].str)%h->hsize;
+   unsigned int hi=string_hashfunct(tfidf_dict_string(h,i,buf))%h->hsize;
    while(h->hitems[hi]!=-1)
     hi=(hi+1)%h->hsize;
    h->hitems[hi]=i;
   } 
 }
 
-void tfidf_dict_sort(tfidf_dict*h,tfidf_dict_compare customtfidf_dict_compare)
-{ 
- qsort(h->items,h->num,sizeof(h->items[0]),customtfidf_dict_compare);
- tfidf_dict_rehash(h);
+// --------------------------------------------------------------------
+// tfidf_dict_sort: the two comparators used by the tool are sorted over
+// compact key/index pairs by all cores (stable lsd radix on the tfidf
+// float bits, then runs of equal keys by string; merge of per thread
+// sorted runs for strings), then items are moved once. The order is the
+// one qsort gives.
+// --------------------------------------------------------------------
+
+typedef struct {
+ const char  *str;
+ unsigned int idx;
+}dict_strkey;
+
+typedef struct {
+ tfidf_dict  *h;
+ size_t       n;
+ int          threads;
+ // radix
+ unsigned int*key,*idx,*tkey,*tidx;
+ size_t      *hist;
+ int          shift;
+ // strings
+ dict_strkey *skey,*stmp;
+ size_t      *bounds;
+ int          step;
+}dict_sortjob;
+
+static unsigned int tfidf_dict_sortkey(float f)
+{
+ unsigned int u;
+ if(f==0) f=0;
+ memcpy(&u,&f,sizeof(u));
+ // ascending unsigned order of floats, then reversed (tfidf descending)
+ u=(u&0x80000000)?~u:(u|0x80000000);
+ return ~u;
 }
 
-int tfidf_dict_export(tfidf_dict*h,
-                      const char*fn,
-                      int what/* 1 cnt | 2 doccnt | 4 tf | 8 idf | 16 tf*idf*/,
-                      size_t cntcut/* 0 no cut, else cnt limit*/,
-                      size_t doccntcut/* 0 no cut, else doccnt limit*/
-                     )
+static void dict_radixkeys(void*ctx,int thread,int threads)
 {
- int  cnt=0;
- FILE*f=fopen(fn,"wb+");
- if(f)
+ dict_sortjob*j=(dict_sortjob*)ctx;
+ size_t       i,from=j->n*thread/threads,to=j->n*(thread+1)/threads;
+ for(i=from;i<to;i++)
   {
-   size_t i;
-   fprintf(f,"# lemma");
-   if(what&1)
-    fprintf(f,"\tcount(%d)",h->lemmas_cnt);
+   j->key[i]=tfidf_dict_sortkey(j->h->items[i].tfidf);
+   j->idx[i]=(unsigned int)i;
+  }
+}
+
+static void dict_radixcount(void*ctx,int thread,int threads)
+{
+ dict_sortjob*j=(dict_sortjob*)ctx;
+ size_t      *hist=j->hist+thread*256,i,from=j->n*thread/threads,to=j->n*(thread+1)/threads;
+ memset(hist,0,256*sizeof(size_t));
+ for(i=from;i<to;i++)
+  hist[(j->key[i]>>j->shift)&0xFF]++;
+}
+
+static void dict_radixscatter(void*ctx,int thread,int threads)
+{
+ dict_sortjob*j=(dict_sortjob*)ctx;
+ size_t      *pos=j->hist+thread*256,i,from=j->n*thread/threads,to=j->n*(thread+1)/threads;
+ for(i=from;i<to;i++)
+  {
+   size_t p=pos[(j->key[i]>>j->shift)&0xFF]++;
+   j->tkey[p]=j->key[i];
+   j->tidx[p]=j->idx[i];
+  }
+}
+
+static int dict_strkeycompare(const void*a,const void*b)
+{
+ return strcmp(((dict_strkey*)a)->str,((dict_strkey*)b)->str);
+}
+
+static void dict_strsort(void*ctx,int thread,int threads)
+{
+ dict_sortjob*j=(dict_sortjob*)ctx;
+ size_t       i,from=j->bounds[thread],to=j->bounds[thread+1];
+ for(i=from;i<to;i++)
+  {
+   j->skey[i].str=j->h->items[i].str;
+   j->skey[i].idx=(unsigned int)i;
+  }
+ qsort(j->skey+from,to-from,sizeof(j->skey[0]),dict_strkeycompare);
+}
+
+// merges runs r and r+step (for every r multiple of 2*step) into stmp
+static void dict_strmerge(void*ctx,int thread,int threads)
+{
+ dict_sortjob*j=(dict_sortjob*)ctx;
+ int          r;
+ for(r=thread*2*j->step;r<j->threads;r+=threads*2*j->step)
+  {
+   size_t a=j->bounds[r],am=j->bounds[min(r+j->step,j->threads)],b=am,bm=j->bounds[min(r+2*j->step,j->threads)],o=a;
+   while((a<am)&&(b<bm))
+    if(strcmp(j->skey[b].str,j->skey[a].str)<0)
+     j->stmp[o++]=j->skey[b++];
+    else
+     j->stmp[o++]=j->skey[a++];
+   while(a<am) j->stmp[o++]=j->skey[a++];
+   while(b<bm) j->stmp[o++]=j->skey[b++];
+  }
+}
+
+static int tfidf_dict_sortradix(tfidf_dict*h,int threads,unsigned int**perm)
+{
+ dict_sortjob j;
+ int          t;
+ memset(&j,0,sizeof(j));
+ j.h=h;
+ j.n=h->num;
+ j.threads=threads;
+ j.key=(unsigned int*)malloc((j.n+1)*sizeof(unsigned int));
+ j.idx=(unsigned int*)malloc((j.n+1)*sizeof(unsigned int));
+ j.tkey=(unsigned int*)malloc((j.n+1)*sizeof(unsigned int));
+ j.tidx=(unsigned int*)malloc((j.n+1)*sizeof(unsigned int));
+ j.hist=(size_t*)malloc(threads*256*sizeof(size_t));
+ if(j.key&&j.idx&&j.tkey&&j.tidx&&j.hist)
+  {
+   parallel_run(threads,dict_radixkeys,&j);
+   for(j.shift=0;j.shift<32;j.shift+=8)
+    {
+     size_t total=0,b;
+     int    single=0;
+     parallel_run(threads,dict_radixcount,&j);
+     for(b=0;b<256;b++)
+      {
+       size_t bucket=0;
+       for(t=0;t<threads;t++)
+        {
+         size_t c=j.hist[t*256+b];
+         j.hist[t*256+b]=total;
+         total+=c;
+         bucket+=c;
+        }
+       if(bucket==j.n)
+        single=1;
+      }
+     // a byte all keys share doesn't move anything
+     if(!single)
+      {
+       unsigned int*s;
+       parallel_run(threads,dict_radixscatter,&j);
+       s=j.key;j.key=j.tkey;j.tkey=s;
+       s=j.idx;j.idx=j.tidx;j.tidx=s;
+      }
+    }
+   // key[i] is the key of idx[i]: equal keys go in string order
+   j.skey=(dict_strkey*)malloc((j.n+1)*sizeof(dict_strkey));
+   if(j.skey)
+    {
+     size_t i,e,k;
+     for(i=0;i<j.n;i=e)
+      {
+       for(e=i+1;(e<j.n)&&(j.key[e]==j.key[i]);e++);
+       if(e-i>1)
+        {
+         for(k=i;k<e;k++)
+          {
+           j.skey[k].str=h->items[j.idx[k]].str;
+           j.skey[k].idx=j.idx[k];
+          }
+         qsort(j.skey+i,e-i,sizeof(j.skey[0]),dict_strkeycompare);
+         for(k=i;k<e;k++)
+          j.idx[k]=j.skey[k].idx;
+        }
+      }
+     *perm=j.idx;
+     j.idx=NULL;
+    }
+  }
+ free(j.key);free(j.idx);free(j.tkey);free(j.tidx);free(j.hist);free(j.skey);
+ return (*perm!=NULL);
+}
+
+static int tfidf_dict_sortstrings(tfidf_dict*h,int threads,unsigned int**perm)
+{
+ dict_sortjob j;
+ int          t;
+ memset(&j,0,sizeof(j));
+ j.h=h;
+ j.n=h->num;
+ j.threads=threads;
+ j.skey=(dict_strkey*)malloc((j.n+1)*sizeof(dict_strkey));
+ j.stmp=(dict_strkey*)malloc((j.n+1)*sizeof(dict_strkey));
+ j.bounds=(size_t*)malloc((threads+1)*sizeof(size_t));
+ *perm=(unsigned int*)malloc((j.n+1)*sizeof(unsigned int));
+ if(j.skey&&j.stmp&&j.bounds&&*perm)
+  {
+   size_t i;
+   for(t=0;t<=threads;t++)
+    j.bounds[t]=j.n*t/threads;
+   parallel_run(threads,dict_strsort,&j);
+   for(j.step=1;j.step<threads;j.step*=2)
+    {
+     dict_strkey*s;
+     parallel_run(min(threads,(threads+2*j.step-1)/(2*j.step)),dict_strmerge,&j);
+     s=j.skey;j.skey=j.stmp;j.stmp=s;
+    }
+   for(i=0;i<j.n;i++)
+    (*perm)[i]=j.skey[i].idx;
+  }
+ else
+  {free(*perm);*perm=NULL;}
+ free(j.skey);free(j.stmp);free(j.bounds);
+ return (*perm!=NULL);
+}
+
+void tfidf_dict_sort(tfidf_dict*h,tfidf_dict_compare customtfidf_dict_compare)
+{ 
+ unsigned int*perm=NULL;
+ tfidf_lemma *items=NULL;
+ int          threads=(h->num<64*1024)?1:thread_cpus();
+ if((customtfidf_dict_compare==tfidf_dict_tfidfcompare)&&(h->num<0xFFFFFFFF))
+  tfidf_dict_sortradix(h,threads,&perm);
+ else
+ if((customtfidf_dict_compare==tfidf_dict_stringcompare)&&(h->num<0xFFFFFFFF))
+  tfidf_dict_sortstrings(h,threads,&perm);
+ if(perm)
+  items=(tfidf_lemma*)malloc((h->size+1)*sizeof(tfidf_lemma));
+ if(items)
+  {
+   size_t i;
+   for(i=0;i<h->num;i++)
+    items[i]=h->items[perm[i]];
+   free(h->items);
+   h->items=items;
+  }
+ else
+  qsort(h->items,h->num,sizeof(h->items[0]),customtfidf_dict_compare);
+ free(perm);
+ tfidf_dict_rehash(h);
+}
+
+// same cut rules used by tfidf_dict_export (no cuts at all if both limits are 0)
+int tfidf_dict_exportable(tfidf_dict*h,size_t i,size_t cntcut,size_t doccntcut)
+{
+ if((cntcut==0)&&(doccntcut==0))
+  return 1;
+ else
+ if((h->items[i].cnt<=cntcut)||((doccntcut>256)&&(h->items[i].doccnt<=doccntcut)))
+  return 0;
+ else 
+ if((h->docs_cnt>1)&&(h->items[i].tfidf<=0.0f))
+  return 0;
+ else
+  return 1;
+}
+
+// same text as printf "%llu"
+static char*export_count(char*p,unsigned long long u)
+{
+ char tmp[24];
+ int  n=0;
+ do
+  {
+   tmp[n++]=(char)('0'+u%10);
+   u/=10;
+  }
+ while(u);
+ while(n) *p++=tmp[--n];
+ return p;
+}
+
+// same text as printf "%.4f": a float times 10000 is exact in a double,
+// and nearbyint rounds half to even like printf does on exact values
+static char*export_float4(char*p,float v)
+{
+ double x=(double)v*10000.0;
+ if((x!=x)||(x>1e15)||(x<-1e15))
+  return p+sprintf(p,"%.4f",v);
+ else
+  {
+   long long r=(long long)nearbyint(fabs(x));
+   char      tmp[24];
+   int       n=0;
+   if(signbit(v)) *p++='-';
+   do
+    {
+     tmp[n++]=(char)('0'+r%10);
+     r/=10;
+    }
+   while(r||(n<5));
+   while(n>4) *p++=tmp[--n];
+   *p++='.';
+   while(n) *p++=tmp[--n];
+   return p;
+  }
+}
+
+int tfidf_dict_export(tfidf_dict*h,
+                      const char*fn,
+                      int what/* 1 cnt | 2 doccnt | 4 tf | 8 idf | 16 tf*idf*/,
+                      size_t cntcut/* 0 no cut, else cnt limit*/,
+                      size_t doccntcut/* 0 no cut, else doccnt limit*/
+                     )
+{
+ int  cnt=0,err=0;
+ FILE*f=fopen(fn,"wb+");
+ if(f)
+  {
+   size_t i,bufsize=1024*1024,at=0;
+   char  *buf=(char*)malloc(bufsize),sbuf[tfidf_dict_maxstr];
+   fprintf(f,"# lemma");
+   if(what&1)
+    fprintf(f,"\tcount(%llu)",(unsigned long long)h->lemmas_cnt);
    if(what&2)
-    fprintf(f,"\tdoccount(%d)",h->docs_cnt);    
+    fprintf(f,"\tdoccount(%llu)",(unsigned long long)h->docs_cnt);    
    if(what&4)
     fprintf(f,"\tTFxIDF");        
    fprintf(f,"\r\n");
    for(i=0;i<h->num;i++)
-    if((h->items[i].cnt<=cntcut)||((doccntcut>256)&&(h->items[i].doccnt<=doccntcut)))
-     ;
-    else 
-    if((h->docs_cnt>1)&&(h->items[i].tfidf<=0.0f))
-     ;
-    else 
+    if(tfidf_dict_exportable(h,i,cntcut,doccntcut))
      {      
-      fprintf(f,"%s",h->items[i].str);
-      if(what&1)
-       fprintf(f,"\t%d",h->items[i].cnt);
-      if(what&2)
-       fprintf(f,"\t%d",h->items[i].doccnt);       
-      if(what&4)
-       fprintf(f,"\t%.4f",h->items[i].tfidf);                            
-      fprintf(f,"\r\n");      
+      const char*str=tfidf_dict_string(h,i,sbuf);
+      size_t     len=strlen(str);
+      if(buf&&(at+len+96>bufsize))
+       {
+        if(fwrite(buf,1,at,f)!=at) err++;
+        at=0;
+       }
+      if(buf&&(len+96<=bufsize))
+       {
+        char*p=buf+at;
+        memcpy(p,str,len);
+        p+=len;
+        if(what&1)
+         {*p++='\t';p=export_count(p,h->items[i].cnt);}
+        if(what&2)
+         {*p++='\t';p=export_count(p,h->items[i].doccnt);}
+        if(what&4)
+         {*p++='\t';p=export_float4(p,h->items[i].tfidf);}
+        *p++='\r';
+        *p++='\n';
+        at=p-buf;
+       }
+      else
+       {
+        fprintf(f,"%s",str);
+        if(what&1)
+         fprintf(f,"\t%llu",(unsigned long long)h->items[i].cnt);
+        if(what&2)
+         fprintf(f,"\t%llu",(unsigned long long)h->items[i].doccnt);       
+        if(what&4)
+         fprintf(f,"\t%.4f",h->items[i].tfidf);                            
+        fprintf(f,"\r\n");      
+       }
       cnt++;
      } 
-   fclose(f);  
+   if(buf&&at)
+    if(fwrite(buf,1,at,f)!=at) err++;
+   free(buf);
+   if(fclose(f)!=0) err++;
   }
- return cnt; 
+ return err?0:cnt; 
 }
 
-tfidf_lemma*tfidf_dict_find(tfidf_dict*h,const char*lemma)
+// buf (packed->maxlen+1 chars) is only used by packed dictionaries: with
+// their own buffer concurrent readers don't share one
+tfidf_lemma*tfidf_dict_findbuf(tfidf_dict*h,const char*lemma,unsigned int hash,char*buf)
 {
- unsigned int i=string_hashfunct(lemma)%h->hsize;
+ unsigned int i;
+ if(h->packed&&h->packed->sorted)
+  {
+   long long id=front_coded_find(h->packed,lemma,buf);
+   return (id==-1)?NULL:&h->items[id];
+  }
+ i=hash%h->hsize;
  while(h->hitems[i]!=-1)
-  if(strcmp(h->items[h->hitems[i]].str,lemma)==0)
+  if(strcmp(h->packed?front_coded_get(h->packed,h->hitems[i],buf):h->items[h->hitems[i]].str,lemma)==0)
    return &h->items[h->hitems[i]];
   else 
    i=(i+1)%h->hsize;
  return NULL;  
 }
 
+// hash is string_hashfunct(lemma), when the caller already has it
+tfidf_lemma*tfidf_dict_findhash(tfidf_dict*h,const char*lemma,unsigned int hash)
+{
+ char buf[tfidf_dict_maxstr];
+ return tfidf_dict_findbuf(h,lemma,hash,h->packed?buf:NULL);
+}
+
+tfidf_lemma*tfidf_dict_find(tfidf_dict*h,const char*lemma)
+{
+ return tfidf_dict_findhash(h,lemma,string_hashfunct(lemma));
+}
+
 void tfidf_dict_updateglobalstats(tfidf_dict*h,int docid,int cnt)
 {
  if(h->docid!=docid)
@@ -332,9 +1354,11 @@ void tfidf_dict_updateglobalstats(tfidf_dict*h,int docid,int cnt)
  h->lemmas_cnt+=cnt;
 }
 
-tfidf_lemma*tfidf_dict_add(tfidf_dict*h,const char*lemma,int docid,int cnt)
+tfidf_lemma*tfidf_dict_addhash(tfidf_dict*h,const char*lemma,unsigned int hash,int docid,int cnt)
 {
- unsigned int i=string_hashfunct(lemma)%h->hsize,miss=0;
+ unsigned int i=hash%h->hsize,miss=0;
+ if(h->packed)
+  return NULL;
  while(h->hitems[i]!=-1)
   if(strcmp(h->items[h->hitems[i]].str,lemma)==0)
    {
@@ -376,20 +1400,82 @@ tfidf_lemma*tfidf_dict_add(tfidf_dict*h,const char*lemma,int docid,int cnt)
   return NULL; 
 }
 
+tfidf_lemma*tfidf_dict_add(tfidf_dict*h,const char*lemma,int docid,int cnt)
+{
+ return tfidf_dict_addhash(h,lemma,string_hashfunct(lemma),docid,cnt);
+}
+
+// front coded strings and block offsets
+size_t tfidf_dict_packedbytes(const front_coded*fc)
+{
+ return fc->bytes+(fc->num/front_coded_block+2)*sizeof(size_t);
+}
+
+// moves the strings to a front coded store (the dictionary becomes read
+// only): sorted dictionaries drop the hash index too, while items keep
+// their (NULL) str pointers. Returns 1 when packed, -1 when the store
+// would not take less memory than the plain strings (strings not sorted
+// share few prefixes and keep the hash index) or a string is longer than
+// tfidf_dict_maxstr and the dictionary is left as it is, 0 without memory
+int tfidf_dict_pack(tfidf_dict*h)
+{
+ const char**strs=(const char**)malloc((h->num+1)*sizeof(char*));
+ front_coded*fc=(front_coded*)malloc(sizeof(front_coded));
+ size_t      i;
+ int         ret=0;
+ if(strs&&fc&&!h->packed)
+  {
+   for(i=0;i<h->num;i++)
+    strs[i]=h->items[i].str;
+   if(front_coded_new(fc,strs,h->num))
+    {
+     size_t used,reserved,packed=tfidf_dict_packedbytes(fc);
+     memorybag_bytes(&h->heap,&used,&reserved);
+     if(fc->sorted)
+      packed-=min(packed,h->hsize*sizeof(h->hitems[0]));
+     if((packed>=used)||(fc->maxlen>=tfidf_dict_maxstr))
+      {
+       front_coded_delete(fc);
+       ret=-1;
+      }
+     else
+      {
+       h->packed=fc;
+       fc=NULL;
+       for(i=0;i<h->num;i++)
+        h->items[i].str=NULL;
+       memorybag_delete(&h->heap);
+       memorybag_new(&h->heap);
+       if(h->packed->sorted)
+        {
+         free(h->hitems);
+         h->hitems=NULL;
+         h->hsize=0;
+        }
+       ret=1;
+      }
+    }
+  }
+ free(fc);
+ free(strs);
+ return ret;
+}
+
 const char*gettoken(const char*s,char*out,int outsize,char sep);
 int tfidf_dict_import(tfidf_dict*h,const char*fn)
 {
  FILE*f=fopen(fn,"rb");
  if(f)
   {
-   char   line[2048];
+   char   line[tfidf_dict_maxstr];
    int    icnt=-1,idoccnt=-1,itfidf=-1,c;
-   size_t hm=0;
+   size_t hm=0,lemmas_cnt=0,docs_cnt=0;
    while(!feof(f))
     {
      size_t i=0,lcnt=0,dcnt=0;  
      float  tfidf=0;   
-     fgets(line,sizeof(line)-1,f);
+     if(fgets(line,sizeof(line)-1,f)==NULL)
+      break;
      if((hm==0)&&(memcmp(line,"# lemma",7)==0))
       if(line[7]=='\t')
       {
@@ -400,10 +1486,10 @@ int tfidf_dict_import(tfidf_dict*h,const char*fn)
          char data[64];
          info=gettoken(info,data,sizeof(data),'\t');
          if(memcmp(data,"count(",6)==0)
-          {icnt=c;h->lemmas_cnt=atoi(data+6);}
+          {icnt=c;lemmas_cnt=(size_t)strtoull(data+6,NULL,10);}
          else
          if(memcmp(data,"doccount(",9)==0)
-          {idoccnt=c;h->docs_cnt=atoi(data+9);}
+          {idoccnt=c;docs_cnt=(size_t)strtoull(data+9,NULL,10);}
          else
          if(memcmp(data,"TFxIDF",6)==0)
           itfidf=c;
@@ -427,10 +1513,10 @@ int tfidf_dict_import(tfidf_dict*h,const char*fn)
          i++;
        cnt[j]=0;  
        if(c==icnt)
-        lcnt=atoi(cnt);
+        lcnt=(size_t)strtoull(cnt,NULL,10);
        else 
        if(c==idoccnt)
-        dcnt=atoi(cnt);
+        dcnt=(size_t)strtoull(cnt,NULL,10);
        else
        if(c==itfidf)
         tfidf=(float)atof(cnt);
@@ -448,9 +1534,82 @@ int tfidf_dict_import(tfidf_dict*h,const char*fn)
         }
       } 
     }
-   fclose(f);  
+   // totals are the ones stored in the header, not the ones counted by tfidf_dict_add
+   h->lemmas_cnt=lemmas_cnt;
+   h->docs_cnt=docs_cnt;
+   fclose(f);
+  }
+ return h->num;
+}
+
+// lemmas cut from an exported dictionary are kept, with their counts, in
+// "<dictionary>.cut": update and merge add them back, so that tf*idf is
+// normalized (and cuts applied) as in a single run. Without counts or
+// cuts there is nothing to keep and an old file is removed
+int tfidf_dict_exportcut(tfidf_dict*h,const char*dictionary,int what,size_t cntcut,size_t doccntcut)
+{
+ char*fn=(char*)malloc(strlen(dictionary)+8);
+ int  ret=1;
+ if(fn==NULL)
+  return 0;
+ sprintf(fn,"%s.cut",dictionary);
+ if(((what&3)==3)&&(cntcut||doccntcut))
+  {
+   FILE*f=fopen(fn,"wb+");
+   if(f)
+    {
+     size_t i;
+     char   sbuf[tfidf_dict_maxstr];
+     fprintf(f,"# lemma\tcount(%llu)\tdoccount(%llu)\r\n",(unsigned long long)h->lemmas_cnt,(unsigned long long)h->docs_cnt);
+     for(i=0;i<h->num;i++)
+      if(!tfidf_dict_exportable(h,i,cntcut,doccntcut))
+       fprintf(f,"%s\t%llu\t%llu\r\n",tfidf_dict_string(h,i,sbuf),(unsigned long long)h->items[i].cnt,(unsigned long long)h->items[i].doccnt);
+     if(fclose(f)!=0) ret=0;
+    }
+   else
+    ret=0;
+  }
+ else
+  remove(fn);
+ free(fn);
+ return ret;
+}
+
+// adds the counts of "<dictionary>.cut" (if any) to h, returns the lemmas read
+int tfidf_dict_addcut(tfidf_dict*h,const char*dictionary)
+{
+ char      *fn=(char*)malloc(strlen(dictionary)+8);
+ tfidf_dict*cut;
+ int        hm=0;
+ if(fn==NULL)
+  return 0;
+ sprintf(fn,"%s.cut",dictionary);
+ cut=tfidf_dict_new(8192,8192,1);
+ if(cut&&tfidf_dict_import(cut,fn))
+  {
+   // totals stay the ones of h
+   size_t i,lemmas_cnt=h->lemmas_cnt,docs_cnt=h->docs_cnt;
+   int    docid=h->docid;
+   for(i=0;i<cut->num;i++)
+    {
+     tfidf_lemma*lm=tfidf_dict_find(h,cut->items[i].str);
+     if(lm==NULL)
+      {
+       lm=tfidf_dict_add(h,cut->items[i].str,0,0);
+       if(lm==NULL) break;
+       lm->cnt=lm->doccnt=0;
+      }
+     lm->cnt+=cut->items[i].cnt;
+     lm->doccnt+=cut->items[i].doccnt;
+     hm++;
+    }
+   h->lemmas_cnt=lemmas_cnt;
+   h->docs_cnt=docs_cnt;
+   h->docid=docid;
   }
- return h->num; 
+ if(cut) tfidf_dict_delete(cut);
+ free(fn);
+ return hm;
 }
 
 // --------------------------------------------------------------------
@@ -461,11 +1620,55 @@ int tfidf_dict_import(tfidf_dict*h,const char*fn)
 //
 // --------------------------------------------------------------------
 
+// cell counts are 32 bit, 64 bit in a -DW2N_WIDE build (where cells take
+// 16 bytes): a count that would wrap fails instead (hqcount_add)
+#if defined(W2N_WIDE)
+typedef unsigned long long hqcount;
+typedef long long          hqused;
+#define hqcount_max        0xFFFFFFFFFFFFFFFFull
+#define hqused_max         0x7FFFFFFFFFFFFFFFull
+#else
+typedef unsigned int       hqcount;
+typedef int                hqused;
+#define hqcount_max        0xFFFFFFFFu
+#define hqused_max         0x7FFFFFFFu
+#endif
+
 typedef struct {
  unsigned int   coord;
- unsigned int   cnt;
+#if defined(W2N_WIDE)
+ unsigned int   spare; // always 0: cells have no padding bytes on disk
+#endif
+ hqcount        cnt;
 }hashquad;
 
+// row and get APIs give counts as int
+#define hqcount_int(c) (((c)>0x7FFFFFFF)?0x7FFFFFFF:(int)(c))
+
+static int hqcount_overflows;
+
+static void hqcount_overflow(void)
+{
+ if(hqcount_overflows++==0)
+#if defined(W2N_WIDE)
+  printf("neighborhood count overflow (past 64 bit)\n");
+#else
+  printf("neighborhood count overflow (past 32 bit): use a -DW2N_WIDE build\n");
+#endif
+}
+
+// *cnt+=v, unless the sum does not fit: then *cnt is left as it is
+static int hqcount_add(hqcount*cnt,hqcount v)
+{
+ if(v>hqcount_max-*cnt)
+  {
+   hqcount_overflow();
+   return 0;
+  }
+ *cnt+=v;
+ return 1;
+}
+
 typedef struct {
  int        num,size;
  hashquad  *items;
@@ -536,13 +1739,28 @@ hashquad*hashquads_addex(hashquads*h,hashquad*hl)
   return NULL; 
 }
 
-hashquad*hashquads_add(hashquads*h,unsigned int coord,int cnt,int*newslot)
+#if defined(W2N_STATS)
+static void hashquads_probestats(unsigned int miss)
+{
+ int b=0;
+ while(miss&&(b<17))
+  {miss>>=1;b++;}
+ w2n_stats.probes[b]++;
+}
+#else
+ #define hashquads_probestats(miss)
+#endif
+
+// hash is hashquadfunct(coord), callers that prefetched the slot pass it in
+hashquad*hashquads_addhash(hashquads*h,unsigned int coord,unsigned int hash,hqcount cnt,int*newslot)
 {
- unsigned int i=hashquadfunct(coord)%h->size,miss=0;
+ unsigned int i=hash%h->size,miss=0;
  while(h->items[i].cnt!=0)
   if(h->items[i].coord==coord)
    {
-    h->items[i].cnt+=cnt;
+    if(!hqcount_add(&h->items[i].cnt,cnt))
+     return NULL;
+    hashquads_probestats(miss);
     return &h->items[i];
    } 
   else
@@ -555,6 +1773,7 @@ hashquad*hashquads_add(hashquads*h,unsigned int coord,int cnt,int*newslot)
     {          
      hashquads nh;
      int       nsize;
+     stats_count(rehashes,1);
      if(h->size<65535)
       nsize=h->size*2-17;
      else 
@@ -567,7 +1786,7 @@ hashquad*hashquads_add(hashquads*h,unsigned int coord,int cnt,int*newslot)
         if(h->items[i].cnt)
          hashquads_addex(&nh,&h->items[i]);
        free(h->items);
-       rid=hashquads_add(&nh,coord,cnt,newslot);       
+       rid=hashquads_addhash(&nh,coord,hash,cnt,newslot);       
        h->items=nh.items;
        h->num=nh.num;
        h->size=nh.size;
@@ -580,6 +1799,7 @@ hashquad*hashquads_add(hashquads*h,unsigned int coord,int cnt,int*newslot)
     {          
      h->items[i].coord=coord;
      h->items[i].cnt=cnt;
+     hashquads_probestats(miss);
      if(newslot) *newslot=1;
      return &h->items[i];
     } 
@@ -588,17 +1808,29 @@ hashquad*hashquads_add(hashquads*h,unsigned int coord,int cnt,int*newslot)
   return NULL; 
 }
 
+hashquad*hashquads_add(hashquads*h,unsigned int coord,hqcount cnt,int*newslot)
+{
+ return hashquads_addhash(h,coord,hashquadfunct(coord),cnt,newslot);
+}
+
 typedef struct {
  int            w,h;
  unsigned short size;
- int            used;
+ hqused         used;
  hashquads**q;
+ // tiles of a read only HQUA file are allocated here, not one by one
+ memorybag *heap;
+ // compressed (HQUC) read only file, rows are decoded on request
+ mapped_file               map;
+ const unsigned char      *cdata;
+ const unsigned long long *cblocks;
+ int                       crows,cmaxrow,cblockrows;
 }hquad;
 
 void hquad_new(hquad*hq,unsigned short size,int width,int height)
 {
  int y;
- hq->used=0;
+ memset(hq,0,sizeof(*hq));
  hq->size=size;
  hq->w=((width-1)/hq->size)+1;
  hq->h=((height-1)/hq->size)+1;
@@ -610,17 +1842,33 @@ void hquad_new(hquad*hq,unsigned short size,int width,int height)
 void hquad_delete(hquad*hq)
 {
  int x,y;
- for(y=0;y<hq->h;y++)
+ if(hq->q)
   {
-   for(x=0;x<hq->w;x++)
-    if(hq->q[y][x].size)
-     hashquads_delete(&hq->q[y][x]);
-   free(hq->q[y]);
-  } 
- free(hq->q); 
+   for(y=0;y<hq->h;y++)
+    {
+     if(hq->heap==NULL)
+      for(x=0;x<hq->w;x++)
+       if(hq->q[y][x].size)
+        hashquads_delete(&hq->q[y][x]);
+     free(hq->q[y]);
+    } 
+   free(hq->q); 
+   hq->q=NULL;
+  }
+ if(hq->heap)
+  {
+   memorybag_delete(hq->heap);
+   free(hq->heap);
+   hq->heap=NULL;
+  }
+ if(hq->cdata)
+  {
+   mapped_file_close(&hq->map);
+   hq->cdata=NULL;
+  }
 }
 
-int hquad_set(hquad*hq,int x,int y,int value,int way)
+int hquad_set(hquad*hq,int x,int y,hqcount value,int way)
 { 
  int qx=x/hq->size,qy=y/hq->size;
  if((qx>=0)&&(qx<=hq->w-1)&&(qy>=0)&&(qy<=hq->h-1))
@@ -649,7 +1897,12 @@ int hashquad_compare(const void*a,const void*b)
  if(B->cnt==0) xb=0x7FFFFFFF;
  else          xb=B->coord>>16;
  if(xa-xb)     return xa-xb;
- else          return B->cnt-A->cnt; 
+ else
+ if(A->cnt!=B->cnt)
+  return (B->cnt>A->cnt)-(B->cnt<A->cnt);
+ // equal counts in column order, not in hash table order: full runs,
+ // merges and updates write the same rows
+ else          return (A->coord>B->coord)-(A->coord<B->coord);
 }
 
 int hashquad_simplecompare(const void*a,const void*b)
@@ -675,6 +1928,7 @@ int cnt_compare(const void*a,const void*b)
 int hquad_reduce(hquad*hq,size_t cut)
 {
  int x,y,red=0;
+ stats_timer(t);
  for(y=0;y<hq->h;y++)
   for(x=0;x<hq->w;x++)
    if(hq->q[y][x].items)
@@ -689,12 +1943,15 @@ int hquad_reduce(hquad*hq,size_t cut)
          hq->used--;red++;
         } 
     }
+ stats_elapsed(reduce,t);
+ stats_count(reductions,1);
  return red;   
 }
 
 void hquad_setreadonlymode(hquad*hq)
 {
  int x,y;
+ stats_timer(t);
  for(y=0;y<hq->h;y++)
   for(x=0;x<hq->w;x++)
    if(hq->q[y][x].items)
@@ -708,6 +1965,114 @@ void hquad_setreadonlymode(hquad*hq)
         break;
        }
     }
+ stats_elapsed(readonly,t);
+}
+
+// binary header: "HQUA" w h size used, with 32 bit used and cell counts;
+// a -DW2N_WIDE build writes "HQUW" and the count width in bytes (8) in
+// front of w, used and counts have that width. Both builds read both
+// kinds, a count that does not fit the build fails the read
+int hquad_writeheader(FILE*f,int w,int h,unsigned short size,hqused used)
+{
+ int err=0;
+#if defined(W2N_WIDE)
+ int width=sizeof(hqcount);
+ if(fwrite("HQUW",1,4,f)!=4)                         err++;
+ if(fwrite(&width,1,sizeof(width),f)!=sizeof(width)) err++;
+#else
+ if(fwrite("HQUA",1,4,f)!=4)                         err++;
+#endif
+ if(fwrite(&w,1,sizeof(w),f)!=sizeof(w))             err++;
+ if(fwrite(&h,1,sizeof(h),f)!=sizeof(h))             err++;
+ if(fwrite(&size,1,sizeof(size),f)!=sizeof(size))    err++;
+ if(fwrite(&used,1,sizeof(used),f)!=sizeof(used))    err++;
+ return (err==0);
+}
+
+// reads the header that follows magic, returns the count width in bytes
+// (4 or 8) or 0 when it is not a HQUA/HQUW header
+int hquad_readheader(FILE*f,const char*magic,int*w,int*h,unsigned short*size,hqused*used)
+{
+ int width=4;
+ if(memcmp(magic,"HQUW",4)==0)
+  {
+   if((fread(&width,1,sizeof(width),f)!=sizeof(width))||(width!=8))
+    return 0;
+  }
+ else
+ if(memcmp(magic,"HQUA",4)!=0)
+  return 0;
+ if((fread(w,1,sizeof(*w),f)!=sizeof(*w))||(fread(h,1,sizeof(*h),f)!=sizeof(*h))||
+    (fread(size,1,sizeof(*size),f)!=sizeof(*size)))
+  return 0;
+ if(width==4)
+  {
+   int u;
+   if(fread(&u,1,sizeof(u),f)!=sizeof(u))
+    return 0;
+   *used=u;
+  }
+ else
+  {
+   unsigned long long u;
+   if(fread(&u,1,sizeof(u),f)!=sizeof(u))
+    return 0;
+   if(u>hqused_max)
+    {
+     hqcount_overflow();
+     return 0;
+    }
+   *used=(hqused)u;
+  }
+ return width;
+}
+
+// reads num cells stored with width bytes counts into items
+int hquad_readcells(FILE*f,hashquad*items,int num,int width)
+{
+ if(width==(int)sizeof(hqcount))
+  return (fread(items,sizeof(items[0]),num,f)==(size_t)num);
+ else
+  {
+#if defined(W2N_WIDE)
+   // 32 bit coord/cnt couples, read in the second half of items and
+   // widened front to back (cell i never overwrites a couple after i)
+   unsigned int*src=(unsigned int*)(items+num)-num*2;
+   int          i;
+   if(fread(src,sizeof(src[0])*2,num,f)!=(size_t)num)
+    return 0;
+   for(i=0;i<num;i++)
+    {
+     unsigned int coord=src[i*2],cnt=src[i*2+1];
+     items[i].coord=coord;
+     items[i].spare=0;
+     items[i].cnt=cnt;
+    }
+   return 1;
+#else
+   // coord/spare/64 bit cnt cells, a chunk at a time
+   struct {unsigned int coord,spare; unsigned long long cnt;} buf[256];
+   int i=0;
+   while(i<num)
+    {
+     int n=min(num-i,256),j;
+     if(fread(buf,sizeof(buf[0]),n,f)!=(size_t)n)
+      return 0;
+     for(j=0;j<n;j++,i++)
+      if(buf[j].cnt>hqcount_max)
+       {
+        hqcount_overflow();
+        return 0;
+       }
+      else
+       {
+        items[i].coord=buf[j].coord;
+        items[i].cnt=(hqcount)buf[j].cnt;
+       }
+    }
+   return 1;
+#endif
+  }
 }
 
 int hquad_writebinary(hquad*hq,const char*bin)
@@ -716,11 +2081,7 @@ int hquad_writebinary(hquad*hq,const char*bin)
  if(f)
   {
    int x,y,num=0,err=0;
-   if(fwrite("HQUA",1,4,f)!=4)                                  err++;
-   if(fwrite(&hq->w,1,sizeof(hq->w),f)!=sizeof(hq->w))          err++;
-   if(fwrite(&hq->h,1,sizeof(hq->h),f)!=sizeof(hq->h))          err++;
-   if(fwrite(&hq->size,1,sizeof(hq->size),f)!=sizeof(hq->size)) err++;
-   if(fwrite(&hq->used,1,sizeof(hq->used),f)!=sizeof(hq->used)) err++;
+   if(!hquad_writeheader(f,hq->w,hq->h,hq->size,hq->used))      err++;
    for(y=0;y<hq->h;y++)
     for(x=0;x<hq->w;x++)
      if(hq->q[y][x].items)
@@ -739,30 +2100,180 @@ int hquad_writebinary(hquad*hq,const char*bin)
   return 0; 
 }
 
-size_t hquad_getreadonlyrow(hquad*hq,int y,int*row,int maxelements)
+// --------------------------------------------------------------------
+//
+// hquad compressed rows (HQUC)
+// every row is stored in hquad_getreadonlyrow order as (count,column)
+// couples: counts as zigzag deltas from the previous one, columns as
+// zigzag deltas when the count repeats (absolute otherwise), all packed
+// stream-vbyte style (one control byte = 2 bits length for 4 values)
+// header: "HQUC" w h size used rows maxrow blockrows 0 (HQUA prefix)
+// then (rows/blockrows+1) 64 bit offsets of every block of rows and,
+// per row, varint cells [varint bytes control bytes data bytes]
+//
+// --------------------------------------------------------------------
+
+#define hquc_blockrows 64
+#define hquc_headersize 32
+
+static unsigned char hquc_shuffle[256][16],hquc_length[256];
+static int           hquc_ready;
+
+static void hquc_init(void)
 {
- int    qy=y/hq->size;
- size_t cnt=0;
- if((qy>=0)&&(qy<=hq->h-1))
+ int c,k,j;
+ if(hquc_ready) return;
+ for(c=0;c<256;c++)
   {
-   int x;
-   for(x=0;x<hq->w;x++)
-    if(hq->q[qy][x].size)
-     {
-      int       hm=hq->q[qy][x].num,offset=qy*hq->size;
-      hashquad *items=hq->q[qy][x].items;
-      hashquad  search,*fnd;
-      search.coord=(y-offset)<<16;
-      fnd=(hashquad*)bsearch(&search,items,hm,sizeof(items[0]),hashquad_simplecompare);
-      if(fnd)
-       {
-        int j=fnd-items;
-        while(j&&((items[j-1].coord&0xFFFF0000)==search.coord)) j--;
-        while((j<hm)&&((items[j].coord&0xFFFF0000)==search.coord))
-         {
-          row[cnt++]=(items[j].coord&0xFFFF)+x*hq->size;
-          row[cnt++]=items[j].cnt;
-          if((maxelements!=-1)&&(cnt/2>=(size_t)maxelements))
+   int pos=0;
+   for(k=0;k<4;k++)
+    {
+     int len=((c>>(k*2))&3)+1;
+     for(j=0;j<4;j++)
+      hquc_shuffle[c][k*4+j]=(j<len)?(unsigned char)(pos+j):0x80;
+     pos+=len;
+    }
+   hquc_length[c]=(unsigned char)pos;
+  }
+ hquc_ready=1;
+}
+
+static unsigned int hquc_zigzag(int v)
+{
+ return ((unsigned int)v<<1)^(unsigned int)(v>>31);
+}
+
+static int hquc_unzigzag(unsigned int v)
+{
+ return (int)(v>>1)^-(int)(v&1);
+}
+
+// decodes the 4 values of a control byte, reads up to 16 data bytes
+// (files are padded accordingly)
+static const unsigned char*hquc_decode4(const unsigned char*data,unsigned char c,unsigned int*out)
+{
+#if defined(W2N_SSSE3)
+ __m128i v=_mm_loadu_si128((const __m128i*)data);
+ _mm_storeu_si128((__m128i*)out,_mm_shuffle_epi8(v,_mm_loadu_si128((const __m128i*)hquc_shuffle[c])));
+#else
+ const unsigned char*p=data;
+ int                 k;
+ for(k=0;k<4;k++)
+  {
+   int          len=((c>>(k*2))&3)+1,j;
+   unsigned int v=0;
+   for(j=0;j<len;j++)
+    v|=(unsigned int)p[j]<<(j*8);
+   out[k]=v;
+   p+=len;
+  }
+#endif
+ return data+hquc_length[c];
+}
+
+static size_t hquad_compressedrow(hquad*hq,int y,int*row,int maxelements)
+{
+ const unsigned char*p,*ctrl,*data;
+ unsigned int        n,len,vals[4];
+ size_t              cnt,take;
+ int                 k,prevcnt=0,prevcol=0;
+ if((y<0)||(y>=hq->crows))
+  return 0;
+ p=hq->cdata+hq->cblocks[y/hq->cblockrows];
+ for(k=y%hq->cblockrows;k;k--)
+  {
+   p=varint_get(p,&n);
+   if(n) 
+    {
+     p=varint_get(p,&len);
+     p+=len;
+    }
+  }
+ p=varint_get(p,&n);
+ if(n==0)
+  return 0;
+ p=varint_get(p,&len);
+ take=((maxelements!=-1)&&((size_t)maxelements<n))?(size_t)maxelements:n;
+ ctrl=p;
+ data=p+(n*2+3)/4;
+ for(cnt=0;cnt<take;)
+  {
+   data=hquc_decode4(data,*ctrl++,vals);
+   for(k=0;(k<2)&&(cnt<take);k++,cnt++)
+    {
+     int c=prevcnt-hquc_unzigzag(vals[k*2]);
+     int col=(cnt&&(c==prevcnt))?prevcol+hquc_unzigzag(vals[k*2+1]):(int)vals[k*2+1];
+     row[cnt*2]=col;
+     row[cnt*2+1]=c;
+     prevcnt=c;
+     prevcol=col;
+    }
+  }
+ return take;
+}
+
+// maps a HQUC file: rows are decoded straight from the mapping
+static int hquad_readcompressed(hquad*hq,const char*bin)
+{
+ const unsigned char*d;
+ size_t              blocks;
+ hquc_init();
+ if(!mapped_file_open(&hq->map,bin))
+  return 0;
+ d=hq->map.data;
+ if(hq->map.size>=hquc_headersize)
+  {
+   unsigned short blockrows;
+   int            used;
+   memcpy(&hq->w,d+4,sizeof(hq->w));
+   memcpy(&hq->h,d+8,sizeof(hq->h));
+   memcpy(&hq->size,d+12,sizeof(hq->size));
+   memcpy(&used,d+14,sizeof(used));
+   hq->used=used;
+   memcpy(&hq->crows,d+18,sizeof(hq->crows));
+   memcpy(&hq->cmaxrow,d+22,sizeof(hq->cmaxrow));
+   memcpy(&blockrows,d+26,sizeof(blockrows));
+   hq->cblockrows=blockrows;
+   blocks=(hq->cblockrows)?(size_t)(hq->crows+hq->cblockrows-1)/hq->cblockrows+1:0;
+   if(blocks&&(hq->crows>=0)&&(hquc_headersize+blocks*8<=hq->map.size))
+    {
+     hq->cblocks=(const unsigned long long*)(d+hquc_headersize);
+     hq->cdata=d+hquc_headersize+blocks*8;
+     if(hq->cblocks[blocks-1]+16<=hq->map.size-hquc_headersize-blocks*8)
+      return 1;
+     hq->cdata=NULL;
+    }
+  }
+ mapped_file_close(&hq->map);
+ return 0;
+}
+
+size_t hquad_getreadonlyrow(hquad*hq,int y,int*row,int maxelements)
+{
+ int    qy=y/hq->size;
+ size_t cnt=0;
+ if(hq->cdata)
+  return hquad_compressedrow(hq,y,row,maxelements);
+ if((qy>=0)&&(qy<=hq->h-1))
+  {
+   int x;
+   for(x=0;x<hq->w;x++)
+    if(hq->q[qy][x].size)
+     {
+      int       hm=hq->q[qy][x].num,offset=qy*hq->size;
+      hashquad *items=hq->q[qy][x].items;
+      hashquad  search,*fnd;
+      search.coord=(y-offset)<<16;
+      fnd=(hashquad*)bsearch(&search,items,hm,sizeof(items[0]),hashquad_simplecompare);
+      if(fnd)
+       {
+        int j=fnd-items;
+        while(j&&((items[j-1].coord&0xFFFF0000)==search.coord)) j--;
+        while((j<hm)&&((items[j].coord&0xFFFF0000)==search.coord))
+         {
+          row[cnt++]=(items[j].coord&0xFFFF)+x*hq->size;
+          row[cnt++]=hqcount_int(items[j].cnt);
+          if((maxelements!=-1)&&(cnt/2>=(size_t)maxelements))
            return cnt/2;
           j++;
          }
@@ -772,6 +2283,123 @@ size_t hquad_getreadonlyrow(hquad*hq,int y,int*row,int maxelements)
  return cnt/2;
 }
 
+// writes a read only hquad as a HQUC file (same rows, in the same order,
+// hquad_getreadonlyrow returns from the HQUA file)
+int hquad_writecompressed(hquad*hq,const char*bin)
+{
+ size_t              cols=(size_t)hq->w*hq->size,blocks,b;
+ int                 rows=0,maxrow=0,x,y,err=0;
+ int                *row=(int*)malloc((cols+1)*2*sizeof(int));
+ unsigned int       *vals=(unsigned int*)malloc((cols*2+4)*sizeof(unsigned int));
+ unsigned char      *buf=(unsigned char*)malloc(cols*2*5+32);
+ unsigned long long *offsets=NULL,pos=0;
+ unsigned short      blockrows=hquc_blockrows;
+ FILE               *f=NULL;
+ hquc_init();
+ for(y=0;y<hq->h;y++)
+  for(x=0;x<hq->w;x++)
+   if(hq->q[y][x].num)
+    {
+     rows=max(rows,y*hq->size+(int)(hq->q[y][x].items[hq->q[y][x].num-1].coord>>16)+1);
+#if defined(W2N_WIDE)
+     // rows are coded with int counts and the header has an int used
+     for(b=0;b<(size_t)hq->q[y][x].num;b++)
+      if(hq->q[y][x].items[b].cnt>0x7FFFFFFF)
+       err++;
+#endif
+    }
+#if defined(W2N_WIDE)
+ if(err||(hq->used>0x7FFFFFFF))
+  {
+   printf("compressed rows hold 31 bit counts: write the neighborhood uncompressed\n");
+   free(row);
+   free(vals);
+   free(buf);
+   return 0;
+  }
+#endif
+ blocks=(rows+blockrows-1)/blockrows+1;
+ offsets=(unsigned long long*)calloc(blocks,sizeof(offsets[0]));
+ if(row&&vals&&buf&&offsets)
+  f=fopen(bin,"wb+");
+ if(f)
+  {
+   static const unsigned char pad[hquc_headersize]={0};
+   setvbuf(f,NULL,_IOFBF,4*1024*1024);
+   // header and block index are written again once offsets are known
+   if(fwrite(pad,1,hquc_headersize,f)!=hquc_headersize)                              err++;
+   if(fwrite(offsets,sizeof(offsets[0]),blocks,f)!=blocks)                           err++;
+   for(y=0;(y<rows)&&(err==0);y++)
+    {
+     size_t         n=hquad_getreadonlyrow(hq,y,row,-1),i,nctrl=(n*2+3)/4;
+     unsigned char *p=buf,*ctrl,*data;
+     int            prevcnt=0,prevcol=0;
+     if((y%blockrows)==0)
+      offsets[y/blockrows]=pos;
+     maxrow=max(maxrow,(int)n);
+     for(i=0;i<n;i++)
+      {
+       int col=row[i*2],cnt=row[i*2+1];
+       vals[i*2]=hquc_zigzag(prevcnt-cnt);
+       vals[i*2+1]=(i&&(cnt==prevcnt))?hquc_zigzag(col-prevcol):(unsigned int)col;
+       prevcnt=cnt;
+       prevcol=col;
+      }
+     p=varint_put(p,(unsigned int)n);
+     if(n)
+      {
+       // the control and data bytes go after the varint byte length, built
+       // at the end of buf first and then moved in place
+       ctrl=buf+cols*2*5+32-(nctrl+n*2*4);
+       data=ctrl+nctrl;
+       memset(ctrl,0,nctrl);
+       for(i=0;i<n*2;i++)
+        {
+         unsigned int v=vals[i];
+         int          len=(v<0x100)?1:((v<0x10000)?2:((v<0x1000000)?3:4)),j;
+         ctrl[i/4]|=(unsigned char)((len-1)<<((i%4)*2));
+         for(j=0;j<len;j++)
+          *data++=(unsigned char)(v>>(j*8));
+        }
+       p=varint_put(p,(unsigned int)(data-ctrl));
+       memmove(p,ctrl,data-ctrl);
+       p+=data-ctrl;
+      }
+     if(fwrite(buf,1,p-buf,f)!=(size_t)(p-buf)) err++;
+     pos+=p-buf;
+     if((y%1024)==0)
+      printf("rows: %d   \r",y);
+    }
+   for(b=(rows+blockrows-1)/blockrows;b<blocks;b++)
+    offsets[b]=pos;
+   // padding for the 16 bytes loads of the decoder
+   if(fwrite(pad,1,16,f)!=16) err++;
+   if(file_seek(f,0)!=0)                                                             err++;
+   else
+    {
+     int zero=0,used=(int)hq->used;
+     if(fwrite("HQUC",1,4,f)!=4)                                                     err++;
+     if(fwrite(&hq->w,1,sizeof(hq->w),f)!=sizeof(hq->w))                             err++;
+     if(fwrite(&hq->h,1,sizeof(hq->h),f)!=sizeof(hq->h))                             err++;
+     if(fwrite(&hq->size,1,sizeof(hq->size),f)!=sizeof(hq->size))                    err++;
+     if(fwrite(&used,1,sizeof(used),f)!=sizeof(used))                                err++;
+     if(fwrite(&rows,1,sizeof(rows),f)!=sizeof(rows))                                err++;
+     if(fwrite(&maxrow,1,sizeof(maxrow),f)!=sizeof(maxrow))                          err++;
+     if(fwrite(&blockrows,1,sizeof(blockrows),f)!=sizeof(blockrows))                 err++;
+     if(fwrite(&zero,1,sizeof(zero),f)!=sizeof(zero))                                err++;
+     if(fwrite(offsets,sizeof(offsets[0]),blocks,f)!=blocks)                         err++;
+    }
+   if(fclose(f)!=0) err++;
+  }
+ else
+  err++;
+ free(row);
+ free(vals);
+ free(buf);
+ free(offsets);
+ return (err==0);
+}
+
 int hquad_writetext(hquad*hq,tfidf_dict*dict,const char*text,int neighborhoodsize)
 {
  FILE*f=fopen(text,"wb+");
@@ -779,16 +2407,16 @@ int hquad_writetext(hquad*hq,tfidf_dict*dict,const char*text,int neighborhoodsiz
   {
    size_t x,y;
    int*row=(int*)calloc(neighborhoodsize*2,sizeof(int));
+   char sbuf[tfidf_dict_maxstr];
    for(y=0;y<dict->num;y++)     
     {
      size_t rowcnt=hquad_getreadonlyrow(hq,y,row,neighborhoodsize);
      if(rowcnt) 
       {
-       const char*szx=dict->items[y].str;
-       fprintf(f,"%s: ",szx);
+       fprintf(f,"%s: ",tfidf_dict_string(dict,y,sbuf));
        for(x=0;x<rowcnt;x++)
         {
-         const char*szy=dict->items[row[x*2]].str;
+         const char*szy=tfidf_dict_string(dict,row[x*2],sbuf);
          int        cnt=row[x*2+1];
          if(x)
           fprintf(f,", %s_%d",szy,cnt);
@@ -811,30 +2439,30 @@ int hquad_writetext(hquad*hq,tfidf_dict*dict,const char*text,int neighborhoodsiz
 int hquad_readbinary(hquad*hq,const char*bin)
 {
  FILE*f=fopen(bin,"rb");
+ memset(hq,0,sizeof(*hq));
  if(f)
   {   
-   char magic[4];
-   int  ret=1,num=0;
-   if((fread(magic,1,4,f)==4)&&(memcmp(magic,"HQUA",4)==0))
+   char magic[4]={0};
+   int  ret=1,num=0,width;
+   if((fread(magic,1,4,f)==4)&&(memcmp(magic,"HQUC",4)==0))
+    {
+     fclose(f);
+     return hquad_readcompressed(hq,bin);
+    }
+   else
+   if((memcmp(magic,"HQUA",4)==0)||(memcmp(magic,"HQUW",4)==0))
     {
      int    x,y;     
-     size_t read;
-     if(fread(&hq->w,1,sizeof(hq->w),f)!=sizeof(hq->w)) 
-      ret=0;
-     else 
-     if(fread(&hq->h,1,sizeof(hq->h),f)!=sizeof(hq->h))
-      ret=0;
-     else 
-     if(fread(&hq->size,1,sizeof(hq->size),f)!=sizeof(hq->size))
-      ret=0;
-     else 
-     if(fread(&hq->used,1,sizeof(hq->used),f)!=sizeof(hq->used))
+     if((width=hquad_readheader(f,magic,&hq->w,&hq->h,&hq->size,&hq->used))==0)
       ret=0; 
      else
       { 
        hq->q=calloc(hq->h,sizeof(hashquads*));
        for(y=0;y<hq->h;y++)
         hq->q[y]=(hashquads*)calloc(hq->w,sizeof(hashquads));
+       hq->heap=(memorybag*)malloc(sizeof(memorybag));
+       if(hq->heap)
+        memorybag_new(hq->heap);
        for(y=0;(y<hq->h)&&ret;y++)
         for(x=0;(x<hq->w)&&ret;x++)
          if(fread(&num,1,sizeof(num),f)!=sizeof(num))
@@ -843,8 +2471,11 @@ int hquad_readbinary(hquad*hq,const char*bin)
           if(num)
            {
             hq->q[y][x].size=hq->q[y][x].num=num;
-            hq->q[y][x].items=(hashquad*)malloc(num*sizeof(hq->q[y][x].items[0]));
-            if((read=fread(hq->q[y][x].items,1,num*sizeof(hq->q[y][x].items[0]),f))!=num*sizeof(hq->q[y][x].items[0]))
+            hq->q[y][x].items=(hashquad*)(hq->heap?memorybag_allocex(hq->heap,num*sizeof(hq->q[y][x].items[0]),sizeof(hqcount)):NULL);
+            if(hq->q[y][x].items==NULL)
+             {hq->q[y][x].size=hq->q[y][x].num=0;ret=0;}
+            else
+            if(!hquad_readcells(f,hq->q[y][x].items,num,width))
              ret=0;
            }         
       }   
@@ -858,6 +2489,319 @@ int hquad_readbinary(hquad*hq,const char*bin)
   return 0; 
 }
 
+// adds the rows of a HQUC file into a writable hquad, tiles get the
+// same starting size (and so the same layout) hquad_addbinary gives them
+static int hquad_addcompressed(hquad*hq,const char*bin)
+{
+ hquad src;
+ int   ret=0;
+ if(hquad_readbinary(&src,bin))
+  {
+   int*row=(int*)malloc(((size_t)src.cmaxrow+1)*2*sizeof(int));
+   int*tilenum=(int*)calloc((size_t)src.w*src.h+1,sizeof(int));
+   ret=(row!=NULL)&&(tilenum!=NULL)&&(src.cdata!=NULL)&&(src.size==hq->size)&&(src.w<=hq->w)&&(src.h<=hq->h);
+   if(ret)
+    {
+     int y;
+     for(y=0;y<src.crows;y++)
+      {
+       size_t n=hquad_getreadonlyrow(&src,y,row,-1),i;
+       for(i=0;i<n;i++)
+        tilenum[(y/src.size)*src.w+row[i*2]/src.size]++;
+      }
+     for(y=0;(y<src.crows)&&ret;y++)
+      {
+       size_t n=hquad_getreadonlyrow(&src,y,row,-1),i;
+       for(i=0;i<n;i++)
+        {
+         hashquads*t=&hq->q[y/hq->size][row[i*2]/hq->size];
+         int       newslot=0;
+         if(t->size==0) hashquads_new(t,max(683,tilenum[(y/src.size)*src.w+row[i*2]/src.size]*2+17));
+         if(hashquads_add(t,(row[i*2]%hq->size)|((y%hq->size)<<16),row[i*2+1],&newslot)==NULL)
+          {ret=0;break;}
+         if(newslot)
+          hq->used++;
+        }
+      }
+    }
+   free(row);
+   free(tilenum);
+   hquad_delete(&src);
+  }
+ return ret;
+}
+
+// adds the counts of a binary file into a writable hquad (same tile size,
+// file grid not larger than hq one): tiles are read one at a time
+int hquad_addbinary(hquad*hq,const char*bin)
+{
+ FILE*f=fopen(bin,"rb");
+ if(f)
+  {   
+   char           magic[4]={0};
+   int            ret=1,w,h,width,num=0,x,y,j,bufsize=0;
+   hqused         used;
+   unsigned short size;
+   hashquad      *buf=NULL;
+   if((fread(magic,1,4,f)==4)&&(memcmp(magic,"HQUC",4)==0))
+    {
+     fclose(f);
+     return hquad_addcompressed(hq,bin);
+    }
+   setvbuf(f,NULL,_IOFBF,4*1024*1024);
+   if(((width=hquad_readheader(f,magic,&w,&h,&size,&used))==0)||
+      (size!=hq->size)||(w>hq->w)||(h>hq->h))
+    ret=0;
+   for(y=0;(y<h)&&ret;y++)
+    for(x=0;(x<w)&&ret;x++)
+     if(fread(&num,1,sizeof(num),f)!=sizeof(num))
+      ret=0;
+     else 
+     if(num)
+      {
+       hashquads*t=&hq->q[y][x];
+       if(num>bufsize)
+        {
+         bufsize=num;
+         buf=(hashquad*)realloc(buf,bufsize*sizeof(buf[0]));
+        }
+       if(!hquad_readcells(f,buf,num,width))
+        ret=0;
+       else
+        {
+         if(t->size==0) hashquads_new(t,max(683,num*2+17));
+         for(j=0;j<num;j++)
+          {
+           int newslot=0;
+           if(hashquads_add(t,buf[j].coord,buf[j].cnt,&newslot)==NULL)
+            {ret=0;break;}
+           if(newslot)
+            hq->used++;
+          }
+        }
+      }
+   free(buf);
+   fclose(f);
+   return ret;   
+  }    
+ else
+  return 0; 
+}
+
+// moves every cell of src into dst with both ids translated by remap
+// (-1 = dropped); src tiles are freed as soon as they are copied
+int hquad_remap(hquad*src,hquad*dst,const int*remap,size_t remapsize)
+{
+ int x,y,j,err=0;
+ if(src->cdata)
+  {
+   int*row=(int*)malloc(((size_t)src->cmaxrow+1)*2*sizeof(int));
+   if(row==NULL)
+    return 0;
+   for(y=0;(y<src->crows)&&((size_t)y<remapsize);y++)
+    if(remap[y]!=-1)
+     {
+      size_t n=hquad_getreadonlyrow(src,y,row,-1),i;
+      for(i=0;i<n;i++)
+       if(((size_t)row[i*2]<remapsize)&&(remap[row[i*2]]!=-1))
+        if(hquad_set(dst,remap[row[i*2]],remap[y],row[i*2+1],1)!=1)
+         err++;
+     }
+   free(row);
+   return (err==0);
+  }
+ for(y=0;y<src->h;y++)
+  for(x=0;x<src->w;x++)
+   if(src->q[y][x].items)
+    {
+     hashquads*t=&src->q[y][x];
+     for(j=0;j<t->size;j++)
+      if(t->items[j].cnt)
+       {
+        size_t ox=(size_t)x*src->size+(t->items[j].coord&0xFFFF),oy=(size_t)y*src->size+(t->items[j].coord>>16);
+        if((ox<remapsize)&&(oy<remapsize)&&(remap[ox]!=-1)&&(remap[oy]!=-1))
+         if(hquad_set(dst,remap[ox],remap[oy],t->items[j].cnt,1)!=1)
+          err++;
+       }
+     if(src->heap==NULL)
+      hashquads_delete(t);
+     t->items=NULL;t->size=t->num=0;
+    }
+ return (err==0);
+}
+
+// --------------------------------------------------------------------
+//
+// hquad_stream
+// sequential tile by tile reader of a binary hquad file, and a k-way
+// merge of files with the same grid that sums counts row by row holding
+// just one tile of each input in memory
+//
+// --------------------------------------------------------------------
+
+typedef struct {
+ FILE          *f;
+ int            w,h,width;
+ hqused         used;
+ unsigned short size;
+ int            num,bufsize;
+ hashquad      *items;
+}hquad_stream;
+
+int hquad_stream_open(hquad_stream*s,const char*bin)
+{
+ char magic[4];
+ memset(s,0,sizeof(*s));
+ s->f=fopen(bin,"rb");
+ if(s->f)
+  {
+   setvbuf(s->f,NULL,_IOFBF,1024*1024);
+   if((fread(magic,1,4,s->f)==4)&&((s->width=hquad_readheader(s->f,magic,&s->w,&s->h,&s->size,&s->used))!=0))
+    return 1;
+   fclose(s->f);
+   s->f=NULL;
+  }
+ return 0;
+}
+
+// reads next tile in items[0..num-1]
+int hquad_stream_next(hquad_stream*s)
+{
+ if(fread(&s->num,1,sizeof(s->num),s->f)!=sizeof(s->num))
+  return 0;
+ if(s->num>s->bufsize)
+  {
+   s->bufsize=s->num;
+   s->items=(hashquad*)realloc(s->items,s->bufsize*sizeof(s->items[0]));
+   if(s->items==NULL)
+    return 0;
+  }
+ if(s->num)
+  if(!hquad_readcells(s->f,s->items,s->num,s->width))
+   return 0;
+ return 1;
+}
+
+void hquad_stream_close(hquad_stream*s)
+{
+ if(s->f)     fclose(s->f);
+ if(s->items) free(s->items);
+ memset(s,0,sizeof(*s));
+}
+
+int hashquad_coordcompare(const void*a,const void*b)
+{
+ unsigned int ca=((hashquad*)a)->coord,cb=((hashquad*)b)->coord;
+ return (ca>cb)-(ca<cb);
+}
+
+int hquad_mergebinary(const char**bins,int n,const char*out)
+{
+ hquad_stream*in=(hquad_stream*)calloc(n,sizeof(hquad_stream));
+ int         *pos=(int*)calloc(n,sizeof(int)),k,x,y,ret=1;
+ hqused       used=0;
+ hashquad    *rows=NULL,*outitems=NULL;
+ int          rowssize=0,outsize=0;
+ FILE        *f=NULL;
+ for(k=0;(k<n)&&ret;k++)
+  if(!hquad_stream_open(&in[k],bins[k]))
+   ret=0;
+  else
+  if(k&&((in[k].w!=in[0].w)||(in[k].h!=in[0].h)||(in[k].size!=in[0].size)))
+   ret=0;
+ if(ret)
+  {
+   f=fopen(out,"wb+");
+   if(f==NULL)
+    ret=0;
+   else
+    {
+     setvbuf(f,NULL,_IOFBF,4*1024*1024);
+     if(!hquad_writeheader(f,in[0].w,in[0].h,in[0].size,used))
+      ret=0;
+    }
+  }
+ for(y=0;(y<in[0].h)&&ret;y++)
+  for(x=0;(x<in[0].w)&&ret;x++)
+   {
+    int total=0,num=0;
+    for(k=0;k<n;k++)
+     {
+      if(!hquad_stream_next(&in[k]))
+       ret=0;
+      total+=in[k].num;
+      pos[k]=0;
+     }
+    if(!ret)
+     break;
+    if(total>outsize)
+     {
+      hashquad*items=(hashquad*)realloc(outitems,total*sizeof(outitems[0]));
+      if(items==NULL)
+       {ret=0;break;}
+      outitems=items;
+      outsize=total;
+     }
+    if(total>rowssize)
+     {
+      hashquad*items=(hashquad*)realloc(rows,total*sizeof(rows[0]));
+      if(items==NULL)
+       {ret=0;break;}
+      rows=items;
+      rowssize=total;
+     }
+    // tiles are sorted by row: take the lowest pending row from every input
+    while(1)
+     {
+      unsigned int ry=0xFFFFFFFF;
+      int          hm=0,j,start=num;
+      for(k=0;k<n;k++)
+       if((pos[k]<in[k].num)&&((in[k].items[pos[k]].coord>>16)<ry))
+        ry=in[k].items[pos[k]].coord>>16;
+      if(ry==0xFFFFFFFF)
+       break;
+      for(k=0;k<n;k++)
+       while((pos[k]<in[k].num)&&((in[k].items[pos[k]].coord>>16)==ry))
+        rows[hm++]=in[k].items[pos[k]++];
+      qsort(rows,hm,sizeof(rows[0]),hashquad_coordcompare);
+      for(j=0;j<hm;j++)
+       if((num>start)&&(outitems[num-1].coord==rows[j].coord))
+        {
+         if(!hqcount_add(&outitems[num-1].cnt,rows[j].cnt))
+          ret=0;
+        }
+       else
+        outitems[num++]=rows[j];
+      qsort(outitems+start,num-start,sizeof(outitems[0]),hashquad_compare);
+     }
+    used+=num;
+    if(fwrite(&num,1,sizeof(num),f)!=sizeof(num))
+     ret=0;
+    else
+    if(num&&(fwrite(outitems,1,num*sizeof(outitems[0]),f)!=num*sizeof(outitems[0])))
+     ret=0;
+   }
+ if(f)
+  {
+   // used is known only at the end
+   if(ret)
+    if((file_seek(f,0)!=0)||!hquad_writeheader(f,in[0].w,in[0].h,in[0].size,used))
+     ret=0;
+   if(fclose(f)!=0)
+    ret=0;
+   // no partial output
+   if(!ret)
+    remove(out);
+  }
+ for(k=0;k<n;k++)
+  hquad_stream_close(&in[k]);
+ free(in);
+ free(pos);
+ free(rows);
+ free(outitems);
+ return ret;
+}
+
 int hquad_get(hquad*hq,int x,int y)
 {
  int qx=x/hq->size,qy=y/hq->size;
@@ -870,7 +2814,7 @@ int hquad_get(hquad*hq,int x,int y)
     { 
      hashquad*item=hashquads_find(&hq->q[qy][qx],(rx|(ry<<16)));
      if(item)
-      return item->cnt;
+      return hqcount_int(item->cnt);
      else
       return 0; 
     }  
@@ -997,69 +2941,612 @@ unsigned int validate_utf8(unsigned int *state, char *str, size_t len)
 
 // --------------------------------------------------------------------
 
-int file_checkutf(FILE*f)
+// utf8 check on the first bytes of a corpus (bom gets the BOM size to skip)
+int buffer_checkutf(char*buf,size_t bytes_read,size_t*bom)
 {
- char         buf[256];
- size_t       bytes_read;
  unsigned int state=UTF8_ACCEPT;
- bytes_read=fread(buf,1,sizeof(buf),f);
  validate_utf8(&state,buf,bytes_read);
+ *bom=0;
  if(state==UTF8_ACCEPT)
   {
    if((bytes_read>=3)&&((unsigned char)buf[0]==239)&&((unsigned char)buf[1]==187)&&((unsigned char)buf[2]==191))
-    fseek(f,3,SEEK_SET);
-   else
-    fseek(f,0,SEEK_SET);
+    *bom=3;
    return 1; 
   }
  else
-  {
-   fseek(f,0,SEEK_SET);
-   return 0; 
-  } 
+  return 0; 
 }
 
-// --------------------------------------------------------------------
-
-void fgetc_read(FILE*f,unsigned char*seq,int cnt)
+int file_checkutf(FILE*f)
 {
- int i=0;
- while(cnt--)
-  if(!feof(f))
-   seq[i++]=(unsigned char)fgetc(f);
-  else 
-   seq[i++]=0;
+ char   buf[256];
+ size_t bytes_read,bom;
+ int    isutf8;
+ bytes_read=fread(buf,1,sizeof(buf),f);
+ isutf8=buffer_checkutf(buf,bytes_read,&bom);
+ fseek(f,(long)bom,SEEK_SET);
+ return isutf8;
 }
 
-int fgetc_wise(FILE*f,int isutf8,unsigned char*seq,int*len)
+// --------------------------------------------------------------------
+//
+// corpus_reader
+// a plain corpus file is read by a thread that keeps up to
+// corpus_reader_blocks blocks ahead of the tokenizer (pread), handed
+// over through a single producer/single consumer ring: two counters,
+// each one written by just one side, so no locks. The tokenizer still
+// gets a FILE (fopencookie) that can tell and seek, for ranges and
+// checkpoints. glibc only, -DW2N_NOREADER leaves it out
+//
+// --------------------------------------------------------------------
+
+#if defined(__GLIBC__)&&!defined(W2N_NOREADER)
+#define W2N_READER
+#include <stdio_ext.h>
+
+#define corpus_reader_blocks 4
+#define corpus_reader_block  (4*1024*1024)
+#define corpus_reader_buffer (256*1024) // FILE buffer, filled from blocks
+
+typedef struct {
+ int          fd;
+ long long    size;
+ long long    offset;   // next byte the tokenizer gets
+ long long    readat;   // next byte the thread reads
+ char        *data[corpus_reader_blocks];
+ size_t       len[corpus_reader_blocks]; // 0: end of file (or error)
+ unsigned int head,tail; // blocks read (thread) and used (tokenizer)
+ size_t       at;        // position in block tail
+ int          running,stop;
+ w2n_thread   thread;
+}corpus_reader;
+
+// the other side is behind: a few yields, then short sleeps
+static void corpus_reader_wait(int*spins)
 {
- int ch=0,l=1,state=UTF8_ACCEPT,i;
- seq[0]=fgetc(f); 
- if((seq[0]<128)||(!isutf8))
-  {
-   ch=seq[0];
-   if(len) *len=l;   
-  } 
- else 
+ if(++*spins<16)
+  sched_yield();
+ else
   {
-   if(seq[0]<224)  l=2;
-   else 
-   if(seq[0]<240)  l=3;
-   else            l=4;
-   fgetc_read(f,seq+1,l-1); 
-   for(i=0;i<l;i++) 
-    decode(&state,(unsigned int*)&ch,seq[i]);
-   if(len) *len=l;
-  }  
- return ch;
+   struct timespec ts={0,100*1000};
+   nanosleep(&ts,NULL);
+  }
 }
 
-int read_raw_word(FILE*f,char*element,int elementsize,char*feat,int featsize,int isutf8)
+static void corpus_reader_run(void*arg)
 {
- char seq[4];
- int  j=0,l,k,ch;
- *feat=0;
- while(!feof(f))
+ corpus_reader*r=(corpus_reader*)arg;
+ int           spins=0;
+ while(!__atomic_load_n(&r->stop,__ATOMIC_ACQUIRE))
+  if(r->head-__atomic_load_n(&r->tail,__ATOMIC_ACQUIRE)==corpus_reader_blocks)
+   corpus_reader_wait(&spins);
+  else
+   {
+    int     slot=r->head%corpus_reader_blocks;
+    ssize_t n=pread(r->fd,r->data[slot],corpus_reader_block,(off_t)r->readat);
+    spins=0;
+    r->len[slot]=(n>0)?(size_t)n:0;
+    r->readat+=r->len[slot];
+    __atomic_store_n(&r->head,r->head+1,__ATOMIC_RELEASE);
+    if(n<=0)
+     break;
+   }
+}
+
+static void corpus_reader_halt(corpus_reader*r)
+{
+ if(r->running)
+  {
+   __atomic_store_n(&r->stop,1,__ATOMIC_RELEASE);
+   thread_join(&r->thread);
+   r->running=r->stop=0;
+  }
+ r->head=r->tail=0;
+ r->at=0;
+}
+
+static ssize_t corpus_reader_read(void*cookie,char*buf,size_t size)
+{
+ corpus_reader*r=(corpus_reader*)cookie;
+ size_t        done=0;
+ int           spins=0;
+ if(!r->running)
+  {
+   r->readat=r->offset;
+   if(!thread_start(&r->thread,corpus_reader_run,r))
+    return -1;
+   r->running=1;
+  }
+ while(done<size)
+  if(__atomic_load_n(&r->head,__ATOMIC_ACQUIRE)==r->tail)
+   {
+    // hand out what is there instead of waiting for more
+    if(done)
+     break;
+    corpus_reader_wait(&spins);
+   }
+  else
+   {
+    int    slot=r->tail%corpus_reader_blocks;
+    size_t n=min(size-done,r->len[slot]-r->at);
+    // the end of file block stays, so later reads get 0 too
+    if(r->len[slot]==0)
+     break;
+    memcpy(buf+done,r->data[slot]+r->at,n);
+    done+=n;
+    r->at+=n;
+    r->offset+=n;
+    if(r->at==r->len[slot])
+     {
+      r->at=0;
+      __atomic_store_n(&r->tail,r->tail+1,__ATOMIC_RELEASE);
+     }
+   }
+ return (ssize_t)done;
+}
+
+static int corpus_reader_seek(void*cookie,off64_t*pos,int whence)
+{
+ corpus_reader*r=(corpus_reader*)cookie;
+ long long     to=*pos;
+ if(whence==SEEK_CUR)
+  to+=r->offset;
+ else
+ if(whence==SEEK_END)
+  to+=r->size;
+ if(to<0)
+  return -1;
+ if(to!=r->offset)
+  {
+   // within the block being used (as the BOM check does) the blocks
+   // read ahead are kept
+   long long start=r->offset-(long long)r->at;
+   if(r->running&&(__atomic_load_n(&r->head,__ATOMIC_ACQUIRE)!=r->tail)&&
+      (to>=start)&&(to<start+(long long)r->len[r->tail%corpus_reader_blocks]))
+    r->at=(size_t)(to-start);
+   else
+    corpus_reader_halt(r);
+   r->offset=to;
+  }
+ *pos=to;
+ return 0;
+}
+
+static int corpus_reader_close(void*cookie)
+{
+ corpus_reader*r=(corpus_reader*)cookie;
+ int           i;
+ corpus_reader_halt(r);
+ for(i=0;i<corpus_reader_blocks;i++)
+  free(r->data[i]);
+ close(r->fd);
+ free(r);
+ return 0;
+}
+
+// NULL if the file can't be opened this way (then fopen is used)
+FILE*corpus_reader_open(const char*fn)
+{
+ corpus_reader        *r=(corpus_reader*)calloc(1,sizeof(corpus_reader));
+ cookie_io_functions_t io={corpus_reader_read,NULL,corpus_reader_seek,corpus_reader_close};
+ struct stat           st;
+ FILE                 *f=NULL;
+ int                   i,ok;
+ if(r==NULL)
+  return NULL;
+ r->fd=open(fn,O_RDONLY);
+ ok=(r->fd!=-1)&&(fstat(r->fd,&st)==0)&&S_ISREG(st.st_mode);
+ for(i=0;(i<corpus_reader_blocks)&&ok;i++)
+  ok=((r->data[i]=(char*)malloc(corpus_reader_block))!=NULL);
+ if(ok)
+  {
+   r->size=(long long)st.st_size;
+#if defined(POSIX_FADV_SEQUENTIAL)
+   posix_fadvise(r->fd,0,0,POSIX_FADV_SEQUENTIAL);
+#endif
+   f=fopencookie(r,"rb",io);
+   if(f)
+    {
+     setvbuf(f,NULL,_IOFBF,corpus_reader_buffer);
+     // just the tokenizer uses it: no stdio locking on every fgetc
+     __fsetlocking(f,FSETLOCKING_BYCALLER);
+    }
+  }
+ if(f==NULL)
+  {
+   for(i=0;i<corpus_reader_blocks;i++)
+    free(r->data[i]);
+   if(r->fd!=-1)
+    close(r->fd);
+   free(r);
+  }
+ return f;
+}
+#endif
+
+// --------------------------------------------------------------------
+//
+// corpus_stream
+// .gz (-DW2N_ZLIB) and .zst (-DW2N_ZSTD) corpus files are decompressed
+// by a thread that writes into a pipe, while the tokenizer reads the
+// other end as a normal FILE: decoding overlaps parsing and nothing is
+// written to disk. The decoder checks utf8/BOM on the first decoded
+// bytes (as file_checkutf does) and sends the result as the first byte.
+// Such a stream can't seek, so ranges and checkpoints need plain files.
+// A corrupted or truncated file sets err, returned by corpus_close: the
+// reader only sees the end of the pipe.
+//
+// --------------------------------------------------------------------
+
+#define corpus_plain 0
+#define corpus_gzip  1
+#define corpus_zstd  2
+
+#define corpus_stream_chunk (1024*1024)
+
+typedef struct {
+ int                kind;
+ FILE              *in;
+ int                fd;
+ w2n_thread         thread;
+ char               head[256];
+ size_t             headnum;
+ int                headsent,err,closed;
+ unsigned long long bytes;
+ int                reader; // plain file read by a corpus_reader
+}corpus_stream;
+
+#if defined(W2N_ZLIB)||defined(W2N_ZSTD)
+static int corpus_stream_write(corpus_stream*cs,const char*buf,size_t n)
+{
+ while(n&&!cs->closed)
+  {
+#if defined(_WIN32)
+   int w=_write(cs->fd,buf,(unsigned int)min(n,(size_t)corpus_stream_chunk));
+#else
+   ssize_t w=write(cs->fd,buf,n);
+#endif
+   // reader gone (it stopped before the end of the corpus)
+   if(w<=0)
+    cs->closed=1;
+   else
+    {buf+=w;n-=w;}
+  }
+ return !cs->closed;
+}
+
+static int corpus_stream_sendhead(corpus_stream*cs)
+{
+ size_t bom;
+ char   isutf8=(char)buffer_checkutf(cs->head,cs->headnum,&bom);
+ cs->headsent=1;
+ cs->bytes-=bom;
+ return corpus_stream_write(cs,&isutf8,1)&&corpus_stream_write(cs,cs->head+bom,cs->headnum-bom);
+}
+
+// every decoded block goes through here
+static int corpus_stream_emit(corpus_stream*cs,const char*buf,size_t n)
+{
+ cs->bytes+=n;
+ if(!cs->headsent)
+  {
+   size_t hm=min(n,sizeof(cs->head)-cs->headnum);
+   memcpy(cs->head+cs->headnum,buf,hm);
+   cs->headnum+=hm;buf+=hm;n-=hm;
+   if(cs->headnum<sizeof(cs->head))
+    return 1;
+   if(!corpus_stream_sendhead(cs))
+    return 0;
+  }
+ return corpus_stream_write(cs,buf,n);
+}
+
+static void corpus_stream_decode(void*arg)
+{
+ corpus_stream*cs=(corpus_stream*)arg;
+ char         *inbuf=(char*)malloc(corpus_stream_chunk),*outbuf=(char*)malloc(corpus_stream_chunk);
+ if(inbuf&&outbuf)
+  {
+#if defined(W2N_ZLIB)
+   if(cs->kind==corpus_gzip)
+    {
+     z_stream z;
+     int      ret=Z_OK,eof=0,ended=0;
+     memset(&z,0,sizeof(z));
+     // 15+32: gzip or zlib header, automatically detected
+     if(inflateInit2(&z,15+32)!=Z_OK)
+      cs->err=1;
+     while(!cs->err)
+      {
+       if((z.avail_in==0)&&!eof)
+        {
+         z.avail_in=(uInt)fread(inbuf,1,corpus_stream_chunk,cs->in);
+         z.next_in=(Bytef*)inbuf;
+         eof=(z.avail_in==0);
+         if(eof&&ferror(cs->in))
+          {printf("\ncan't read gzip stream\n");cs->err=1;break;}
+        }
+       // all read and the last member is complete
+       if(eof&&ended)
+        break;
+       z.next_out=(Bytef*)outbuf;
+       z.avail_out=corpus_stream_chunk;
+       ret=inflate(&z,Z_NO_FLUSH);
+       if((ret!=Z_OK)&&(ret!=Z_STREAM_END)&&(ret!=Z_BUF_ERROR))
+        {printf("\ncorrupted gzip stream\n");cs->err=1;}
+       else
+       // no input left and nothing more to decode: the file was cut
+       if(eof&&(ret==Z_BUF_ERROR))
+        {printf("\ntruncated gzip stream\n");cs->err=1;}
+       if(!corpus_stream_emit(cs,outbuf,corpus_stream_chunk-z.avail_out))
+        break;
+       // concatenated gzip members
+       ended=(ret==Z_STREAM_END);
+       if(ended)
+        inflateReset(&z);
+      }
+     inflateEnd(&z);
+    }
+#endif
+#if defined(W2N_ZSTD)
+   if(cs->kind==corpus_zstd)
+    {
+     ZSTD_DStream  *ds=ZSTD_createDStream();
+     ZSTD_inBuffer  in={inbuf,0,0};
+     // 0 once a frame is decoded and flushed
+     size_t         left=1;
+     int            eof=0;
+     if((ds==NULL)||ZSTD_isError(ZSTD_initDStream(ds)))
+      cs->err=1;
+     while(!cs->err)
+      {
+       ZSTD_outBuffer out={outbuf,corpus_stream_chunk,0};
+       if((in.pos==in.size)&&!eof)
+        {
+         in.size=fread(inbuf,1,corpus_stream_chunk,cs->in);
+         in.pos=0;
+         eof=(in.size==0);
+         if(eof&&ferror(cs->in))
+          {printf("\ncan't read zstd stream\n");cs->err=1;break;}
+        }
+       // all read and the last frame is complete
+       if(eof&&(left==0))
+        break;
+       left=ZSTD_decompressStream(ds,&out,&in);
+       if(ZSTD_isError(left))
+        {printf("\ncorrupted zstd stream (%s)\n",ZSTD_getErrorName(left));cs->err=1;}
+       else
+       // no input left and nothing more to decode: the file was cut
+       if(eof&&(out.pos==0))
+        {printf("\ntruncated zstd stream\n");cs->err=1;}
+       else
+       if(!corpus_stream_emit(cs,outbuf,out.pos))
+        break;
+      }
+     if(ds) ZSTD_freeDStream(ds);
+    }
+#endif
+  }
+ if(!cs->headsent)
+  corpus_stream_sendhead(cs);
+ free(inbuf);
+ free(outbuf);
+#if defined(_WIN32)
+ _close(cs->fd);
+#else
+ close(cs->fd);
+#endif
+}
+#endif
+
+// opens a corpus file for reading, setting isutf8 (file_checkutf)
+FILE*corpus_open(const char*fn,corpus_stream*cs,int*isutf8)
+{
+ int ln=strlen(fn);
+ memset(cs,0,sizeof(*cs));
+ if((ln>3)&&(_strcmpi(fn+ln-3,".gz")==0))
+  cs->kind=corpus_gzip;
+ else
+ if((ln>4)&&(_strcmpi(fn+ln-4,".zst")==0))
+  cs->kind=corpus_zstd;
+#if !defined(W2N_ZLIB)
+ if(cs->kind==corpus_gzip)
+  {printf("gzip corpus support not compiled (-DW2N_ZLIB)\n");return NULL;}
+#endif
+#if !defined(W2N_ZSTD)
+ if(cs->kind==corpus_zstd)
+  {printf("zstd corpus support not compiled (-DW2N_ZSTD)\n");return NULL;}
+#endif
+ if(cs->kind==corpus_plain)
+  {
+   FILE*f=NULL;
+#if defined(W2N_READER)
+   f=corpus_reader_open(fn);
+   cs->reader=(f!=NULL);
+#endif
+   if(f==NULL)
+    f=fopen(fn,"rb");
+   if(f)
+    *isutf8=file_checkutf(f);
+   return f;
+  }
+#if defined(W2N_ZLIB)||defined(W2N_ZSTD)
+ else
+  {
+   FILE*f=NULL;
+   int  fds[2];
+   cs->in=fopen(fn,"rb");
+   if(cs->in==NULL)
+    return NULL;
+   setvbuf(cs->in,NULL,_IOFBF,corpus_stream_chunk);
+#if defined(_WIN32)
+   if(_pipe(fds,4*corpus_stream_chunk,_O_BINARY)==0)
+    f=_fdopen(fds[0],"rb");
+#else
+   // a reader closing early must not kill the process
+   signal(SIGPIPE,SIG_IGN);
+   if(pipe(fds)==0)
+    {
+#if defined(F_SETPIPE_SZ)
+     fcntl(fds[1],F_SETPIPE_SZ,corpus_stream_chunk);
+#endif
+     f=fdopen(fds[0],"rb");
+    }
+#endif
+   if(f==NULL)
+    {fclose(cs->in);return NULL;}
+   setvbuf(f,NULL,_IOFBF,corpus_stream_chunk);
+   cs->fd=fds[1];
+   if(!thread_start(&cs->thread,corpus_stream_decode,cs))
+    {
+#if defined(_WIN32)
+     _close(cs->fd);
+#else
+     close(cs->fd);
+#endif
+     fclose(f);fclose(cs->in);
+     return NULL;
+    }
+   *isutf8=(fgetc(f)==1);
+   return f;
+  }
+#else
+ return NULL;
+#endif
+}
+
+// 0 if a compressed corpus was corrupted or truncated
+int corpus_close(FILE*f,corpus_stream*cs)
+{
+ fclose(f);
+#if defined(W2N_ZLIB)||defined(W2N_ZSTD)
+ if(cs->kind!=corpus_plain)
+  {
+   thread_join(&cs->thread);
+   fclose(cs->in);
+  }
+#endif
+ return !cs->err;
+}
+
+// --------------------------------------------------------------------
+
+void fgetc_read(FILE*f,unsigned char*seq,int cnt)
+{
+ int i=0;
+ while(cnt--)
+  if(!feof(f))
+   seq[i++]=(unsigned char)fgetc(f);
+  else 
+   seq[i++]=0;
+}
+
+int fgetc_wise(FILE*f,int isutf8,unsigned char*seq,int*len)
+{
+ int ch=0,l=1,state=UTF8_ACCEPT,i;
+ seq[0]=fgetc(f); 
+ if((seq[0]<128)||(!isutf8))
+  {
+   ch=seq[0];
+   if(len) *len=l;   
+  } 
+ else 
+  {
+   if(seq[0]<224)  l=2;
+   else 
+   if(seq[0]<240)  l=3;
+   else            l=4;
+   fgetc_read(f,seq+1,l-1); 
+   for(i=0;i<l;i++) 
+    decode(&state,(unsigned int*)&ch,seq[i]);
+   if(len) *len=l;
+  }  
+ return ch;
+}
+
+// --------------------------------------------------------------------
+//
+// token_info
+// class mask and dictionary hash of a token, built while its bytes are
+// appended: utf8 decoding goes on across the token the same way a
+// separate decoding pass would (bytes after an invalid sequence don't
+// count), classes of code points below 0x10000 come from a table
+//
+// --------------------------------------------------------------------
+
+#define token_digits 1 // digits and , . % ' only
+#define token_punct  2 // punctuation only
+#define token_alpha  4 // at least one letter
+
+typedef struct {
+ unsigned int hash,state,code;
+ int          cls;
+}token_info;
+
+static unsigned char token_classes[0x10000],token_byteclasses[256];
+static int           token_classready;
+
+static int token_codeclass(unsigned int code)
+{
+ return ((iswdigit(code)||(code==',')||(code=='.')||(code=='%')||(code=='\''))?token_digits:0)|
+        (iswpunct(code)?token_punct:0)|(iswalpha(code)?token_alpha:0);
+}
+
+void token_classinit(void)
+{
+ unsigned int c;
+ if(token_classready) return;
+ for(c=0;c<0x10000;c++)
+  token_classes[c]=(unsigned char)token_codeclass(c);
+ for(c=0;c<256;c++)
+  token_byteclasses[c]=(unsigned char)(((isdigit(c)||(c==',')||(c=='.')||(c=='%')||(c=='\''))?token_digits:0)|
+                                       (ispunct(c)?token_punct:0)|(isalpha(c)?token_alpha:0));
+ token_classready=1;
+}
+
+static void token_begin(token_info*ti)
+{
+ ti->hash=5381;
+ ti->state=UTF8_ACCEPT;
+ ti->code=0;
+ ti->cls=token_digits|token_punct;
+}
+
+static void token_add(token_info*ti,unsigned char c,int isutf8)
+{
+ int cl;
+ ti->hash=((ti->hash<<5)+ti->hash)+c;
+ if(!isutf8)
+  cl=token_byteclasses[c];
+ else
+ if(decode(&ti->state,&ti->code,c)!=UTF8_ACCEPT)
+  return;
+ else
+  cl=(ti->code<0x10000)?token_classes[ti->code]:token_codeclass(ti->code);
+ ti->cls=(ti->cls&(cl|token_alpha))|(cl&token_alpha);
+}
+
+void token_classify(token_info*ti,const char*word,int isutf8)
+{
+ token_begin(ti);
+ while(*word)
+  token_add(ti,(unsigned char)*word++,isutf8);
+}
+
+int token_filtered(token_info*ti,int filter)
+{
+ return ((filter&filter_digits)&&(ti->cls&token_digits))||((filter&filter_punct)&&(ti->cls&token_punct));
+}
+
+// --------------------------------------------------------------------
+
+int read_raw_word(FILE*f,char*element,int elementsize,char*feat,int featsize,int isutf8,token_info*ti)
+{
+ char seq[4];
+ int  j=0,l,k,ch;
+ *feat=0;
+ token_begin(ti);
+ while(!feof(f))
   {
    ch=fgetc_wise(f,isutf8,seq,&l);
    if((ch==' ')||(ch=='\t')||(ch=='\r')||(ch=='\n'))
@@ -1079,7 +3566,10 @@ int read_raw_word(FILE*f,char*element,int elementsize,char*feat,int featsize,int
      if(j==0)
       {
        for(k=0;k<l;k++)
-        element[j++]=seq[k];
+        {
+         token_add(ti,(unsigned char)seq[k],isutf8);
+         element[j++]=seq[k];
+        }
       } 
      else 
       {
@@ -1098,203 +3588,490 @@ int read_raw_word(FILE*f,char*element,int elementsize,char*feat,int featsize,int
     if(j+l<elementsize)
      {
       for(k=0;k<l;k++)
-       element[j++]=seq[k];
+       {
+        token_add(ti,(unsigned char)seq[k],isutf8);
+        element[j++]=seq[k];
+       }
      } 
   }
  element[j]=0;
  return 1; 
 }
 
+// --------------------------------------------------------------------
+//
+// CoNLL-U tokens: a line is split in place (a plain scan for tabs, up to
+// the last column needed) and just the columns needed are copied into
+// the output. UPOS tags map to their -conllufilter bit.
+//
+// --------------------------------------------------------------------
+
+#define upos_punct 1
+#define upos_det   2
+#define upos_adp   4
+#define upos_adv   8
+#define upos_conj  16 // CCONJ and SCONJ
+#define upos_aux   32
+
+#define conllu_fields   10
+#define conllu_fieldlen (builtin_max_word_len-1)
+
+static int conllu_upos(const char*s,size_t len)
+{
+ switch(len)
+  {
+   case 3:
+    if(memcmp(s,"DET",3)==0) return upos_det;
+    if(memcmp(s,"ADP",3)==0) return upos_adp;
+    if(memcmp(s,"ADV",3)==0) return upos_adv;
+    if(memcmp(s,"AUX",3)==0) return upos_aux;
+   break;
+   case 5:
+    if(memcmp(s,"PUNCT",5)==0) return upos_punct;
+    if(memcmp(s+1,"CONJ",4)==0) return ((*s=='C')||(*s=='S'))?upos_conj:0;
+   break;
+  }
+ return 0;
+}
+
+// appends len chars of s to out (size chars, zero terminated) at *o
+static void conllu_put(char*out,int size,int*o,const char*s,size_t len)
+{
+ if(len>(size_t)(size-1-*o))
+  len=size-1-*o;
+ memcpy(out+*o,s,len);
+ *o+=(int)len;
+ out[*o]=0;
+}
+
 int read_conllu_word(FILE*f,char*element,int elementsize,char*feat,int featsize,int isutf8,int which,int conllufilter)
 {
  if(!feof(f))
   {
-   char line[8192];
+   char        line[8192];
+   const char *field[conllu_fields],*p;
+   size_t      len[conllu_fields],l=0;
+   int         n=0,o=0,fo=0,need=conllu_fields;
+   *line=0;
    while(!feof(f))
-    {
-     fgets(line,sizeof(line),f);
-     removeendingcrlf(line);      
-     if(*line==0)
-      continue;
-     else
-      break; 
-    }
+    if(fgets(line,sizeof(line),f)==NULL)
+     {*line=0;break;}
+    else
+     {
+      l=strlen(line);
+      while(l&&((line[l-1]=='\n')||(line[l-1]=='\r')))
+       line[--l]=0;
+      if(l)
+       break;
+     }
+   *element=*feat=0;
    if((*line=='#')||(*line=='<'))
     {
-     strcpy(element,line);
+     conllu_put(element,elementsize,&o,line,l);
      return 1;
     } 
-   else
+   // split up to the last column needed (fields are short: a plain scan
+   // is quicker than a memchr call each)
+   if(!(which&(256|512)))
+    need=max(which&0x7f,conllufilter?3:0)+1;
+   for(p=line;n<need;)
+    {
+     const char*s=p;
+     while(*p&&(*p!='\t'))
+      p++;
+     field[n]=s;
+     len[n++]=p-s;
+     if(*p==0)
+      break;
+     p++;
+    }
+   // the fields stay in the line, copies are limited
+   if(which&512)
     {
-     int         t=0,odd=0;
-     char        word[builtin_max_word_len],feature[builtin_max_word_len];
-     const char *pline=line;
-     
-     *word=*feature=0;
-     
-     while(pline)
+     // lemma misc \t form (unless misc is empty or #-1)
+     if(n==conllu_fields)
       {
-       char    piece[builtin_max_word_len];
-       pline=gettoken(pline,piece,sizeof(piece)-1,'\t');   
-       if(which&512)
+       if(len[9]&&!((len[9]==3)&&(memcmp(field[9],"#-1",3)==0)))
         {
-         if(t==1)
-          strcpy(feature,piece);
-         else
-         if(t==2)
-          strcpy(word,piece);
-         else
-         if(t==9) 
-          {       
-           if(strcmp(piece,"#-1")==0)
-            *piece=0;       
-           if(*piece) 
-            {
-             strcat(word,piece);
-             strcat(word,"\t");
-             strcat(word,feature);*feature=0; 
-            }
-           else
-            *word=0;  
-           break;
-          }
+         conllu_put(element,elementsize,&o,field[2],min(len[2],(size_t)conllu_fieldlen));
+         conllu_put(element,elementsize,&o,field[9],min(len[9],(size_t)conllu_fieldlen));
+         conllu_put(element,elementsize,&o,"\t",1);
+         conllu_put(element,elementsize,&o,field[1],min(len[1],(size_t)conllu_fieldlen));
         }
-       else 
-       if(which&256)
+      }
+     else
+      {
+       if(n>2) conllu_put(element,elementsize,&o,field[2],min(len[2],(size_t)conllu_fieldlen));
+       if(n>1) conllu_put(feat,featsize,&fo,field[1],min(len[1],(size_t)conllu_fieldlen));
+      }
+    }
+   else 
+   if(which&256)
+    {
+     // misc::lemma (unless misc is empty or #-1)
+     if(n==conllu_fields)
+      {
+       if(len[9]&&!((len[9]==3)&&(memcmp(field[9],"#-1",3)==0)))
         {
-         if(t==2)
-          strcpy(word,piece);
-         else
-         if(t==9) 
-          {
-           strcpy(feature,piece);
-           if((strcmp(feature,"#-1")==0)||(*feature==0))
-            *word=*feature=0;
-           else
-            {
-             strcat(feature,"::");
-             strcat(feature,word);
-             strcpy(word,feature);
-             *feature=0;
-            } 
-           break;
-          }
+         conllu_put(element,elementsize,&o,field[9],min(len[9],(size_t)conllu_fieldlen));
+         conllu_put(element,elementsize,&o,"::",2);
+         conllu_put(element,elementsize,&o,field[2],min(len[2],(size_t)conllu_fieldlen));
         }
-       else 
-        if((which&0x7f)==t)
-         {
-          strcpy(word,piece);
-          if(conllufilter==0)
-           break;
-         } 
-        else 
-        if(conllufilter)
-         if(t==3)
-          {
-           if((strcmp(piece,"PUNCT")==0)&&(conllufilter&1))
-            {*word=*feature=0;break;}
-           else
-           if((strcmp(piece,"DET")==0)&&(conllufilter&2))
-            {*word=*feature=0;break;}
-           else
-           if((strcmp(piece,"ADP")==0)&&(conllufilter&4))
-            {*word=*feature=0;break;}
-           else
-           if((strcmp(piece,"ADV")==0)&&(conllufilter&8))
-            {*word=*feature=0;break;}
-           else
-           if(((strcmp(piece,"CCONJ")==0)||(strcmp(piece,"SCONJ")==0))&&(conllufilter&16))
-            {*word=*feature=0;break;}
-           else
-           if((strcmp(piece,"AUX")==0)&&(conllufilter&32))
-            {*word=*feature=0;break;}
-          }
-       t++; 
-      }     
-     strcpy(element,word); 
-     strcpy(feat,feature);
-     return (*element!=0);
-    } 
-  }
- else
-  return 0; 
-}
+      }
+     else
+     if(n>2)
+      conllu_put(element,elementsize,&o,field[2],min(len[2],(size_t)conllu_fieldlen));
+    }
+   else 
+    {
+     int t=which&0x7f;
+     if((t<n)&&!(conllufilter&&(t!=3)&&(n>3)&&(conllu_upos(field[3],len[3])&conllufilter)))
+      conllu_put(element,elementsize,&o,field[t],min(len[t],(size_t)conllu_fieldlen));
+    }
+   return (*element!=0);
+  }
+ else
+  return 0; 
+}
 
 
 // --------------------------------------------------------------------
+// pairs of a window are combined before they reach the tiles: a small
+// open addressing table sums repeated cells and chains them per tile,
+// then every tile gets its cells in a row with the probe slots of the
+// next cells prefetched. A tile chain keeps the first occurrence order,
+// so the tile tables come out exactly as the pair by pair insertion
+// built them
 
-int addcorpus(hquad*hq,int*items,int cnt,int width,int flags,int*perr)
+#define pairbatch_min      1024       // shorter windows go pair by pair
+#define pairbatch_cells    (512*1024) // below this the tiles still sit in cache
+#define pairbatch_max      (64*1024)
+#define pairbatch_prefetch 8
+
+typedef struct{
+ unsigned int coord,hash; // hash is hashquadfunct(coord)
+ hqcount      cnt;        // checked like the tile cells (hqcount_add)
+ int          tile,next,slot;
+ long long    pairs;
+}paircell;
+
+typedef struct{
+ int tile,first,last,slot;
+}pairtile;
+
+typedef struct{
+ paircell*cells;
+ pairtile*tiles;
+ int     *slots,*tileslots;
+ int      num,ntiles,max,mask;
+ int      lasttile,lastidx;
+}pairbatch;
+
+void pairbatch_delete(pairbatch*b)
 {
- int i,j,err=0,add=0;
- for(i=0;i<cnt;i++)           
-  if(items[i]!=-1)  
-   {
-    for(j=max(0,i-width);j<min(cnt,i+width);j++)
-     if(i!=j)
-      if(items[j]!=-1)
-       if(items[j]!=items[i])
-        {
-         int addval=1;
-         if(flags&1) addval=width-abs(j-i)+1;
-         if(hquad_set(hq,items[j],items[i],addval,1)==-1)
-          err++;
-         else
-          add++; 
-        }  
-   }  
- if(perr) *perr=err;  
- return add;  
+ if(b->cells) free(b->cells);
+ if(b->tiles) free(b->tiles);
+ if(b->slots) free(b->slots);
+ if(b->tileslots) free(b->tileslots);
+ memset(b,0,sizeof(pairbatch));
 }
 
-int filter_word(const char*word,int isutf8,int filter)
+int pairbatch_new(pairbatch*b,int maxcells)
+{
+ int n=64;
+ memset(b,0,sizeof(pairbatch));
+ if(maxcells<pairbatch_min)
+  return 0;
+ while(n<maxcells*2) n<<=1;
+ b->cells=(paircell*)malloc(maxcells*sizeof(paircell));
+ b->tiles=(pairtile*)malloc(maxcells*sizeof(pairtile));
+ b->slots=(int*)malloc(n*sizeof(int));
+ b->tileslots=(int*)malloc(n*sizeof(int));
+ if((b->cells==NULL)||(b->tiles==NULL)||(b->slots==NULL)||(b->tileslots==NULL))
+  {
+   pairbatch_delete(b);
+   return 0;
+  }
+ memset(b->slots,-1,n*sizeof(int));
+ memset(b->tileslots,-1,n*sizeof(int));
+ b->max=maxcells;
+ b->mask=n-1;
+ b->lasttile=-1;
+ return 1;
+}
+
+static int pairbatch_tile(pairbatch*b,int tile)
 {
- if(filter&filter_digits)
+ unsigned int h;
+ if(tile==b->lasttile)
+  return b->lastidx;
+ h=((unsigned int)tile*0x9E3779B1u)&b->mask;
+ while(b->tileslots[h]!=-1)
+  if(b->tiles[b->tileslots[h]].tile==tile)
+   break;
+  else
+   h=(h+1)&b->mask;
+ if(b->tileslots[h]==-1)
+  {
+   pairtile*t=&b->tiles[b->ntiles];
+   t->tile=tile;
+   t->first=t->last=-1;
+   t->slot=h;
+   b->tileslots[h]=b->ntiles++;
+  }
+ b->lasttile=tile;
+ b->lastidx=b->tileslots[h];
+ return b->lastidx;
+}
+
+// returns 0 when the cell is outside the matrix (hquad_set ignores it too),
+// -1 when its count would wrap
+int pairbatch_add(pairbatch*b,hquad*hq,int x,int y,int value)
+{
+ int qx=x/hq->size,qy=y/hq->size;
+ if((qx>=0)&&(qx<=hq->w-1)&&(qy>=0)&&(qy<=hq->h-1))
   {
-   if(isutf8)
+   unsigned int coord=(x%hq->size)|((y%hq->size)<<16),hash=hashquadfunct(coord),h;
+   int          tile=pairbatch_tile(b,qy*hq->w+qx);
+   pairtile    *t;
+   paircell    *c;
+   h=(hash^((unsigned int)tile*0x9E3779B1u))&b->mask;
+   while(b->slots[h]!=-1)
     {
-     unsigned int state=0,code=0;
-     while(*word)
-      if(decode(&state,&code,(unsigned char)*word))
-       word++;
-      else 
-       if(iswdigit(code)||(code==',')||(code=='.')||(code=='%')||(code=='\''))
-        word++;
-       else
-        break;    
+     c=&b->cells[b->slots[h]];
+     if((c->coord==coord)&&(c->tile==tile))
+      {
+       if(!hqcount_add(&c->cnt,value))
+        return -1;
+       c->pairs++;
+       return 1;
+      }
+     h=(h+1)&b->mask;
     }
+   c=&b->cells[b->num];
+   c->coord=coord;
+   c->hash=hash;
+   c->cnt=value;
+   c->pairs=1;
+   c->tile=tile;
+   c->next=-1;
+   c->slot=h;
+   t=&b->tiles[tile];
+   if(t->last==-1)
+    t->first=b->num;
    else
-    while(*word)
-     if(isdigit((unsigned char)*word)||((unsigned char)*word==',')||((unsigned char)*word=='.')||((unsigned char)*word=='%')||((unsigned char)*word=='\''))
-      word++;
+    b->cells[t->last].next=b->num;
+   t->last=b->num;
+   b->slots[h]=b->num++;
+   return 1;
+  }
+ else
+  return 0;
+}
+
+void pairbatch_flush(pairbatch*b,hquad*hq,long long*padd,long long*perr)
+{
+ int t,k;
+ for(t=0;t<b->ntiles;t++)
+  {
+   pairtile *pt=&b->tiles[t];
+   hashquads*hs=&hq->q[pt->tile/hq->w][pt->tile%hq->w];
+   int       ahead=pt->first;
+   if(hs->size==0) hashquads_new(hs,683);
+   for(k=0;(k<pairbatch_prefetch)&&(ahead!=-1);k++)
+    ahead=b->cells[ahead].next;
+   for(k=pt->first;k!=-1;k=b->cells[k].next)
+    {
+     paircell*c=&b->cells[k];
+     int      newslot=0;
+#if defined(__GNUC__)
+     if(ahead!=-1)
+      {
+       __builtin_prefetch(&hs->items[b->cells[ahead].hash%hs->size]);
+       ahead=b->cells[ahead].next;
+      }
+#endif
+     if(hashquads_addhash(hs,c->coord,c->hash,c->cnt,&newslot)==NULL)
+      *perr+=c->pairs;
      else
-      break;
-   if(*word==0)
-    return 1;         
+      {
+       *padd+=c->pairs;
+       if(newslot)
+        hq->used++;
+      }
+    }
+   b->tileslots[pt->slot]=-1;
+  }
+ for(k=0;k<b->num;k++)
+  b->slots[b->cells[k].slot]=-1;
+ b->num=b->ntiles=0;
+ b->lasttile=-1;
+}
+
+// --------------------------------------------------------------------
+
+// --------------------------------------------------------------------
+//
+// pairwindow
+// sliding window on the token stream: a token is paired with the width
+// ones before it as soon as it arrives, both ways (the earlier token row
+// gets it only within width-1, as addcorpus always did), so nothing has
+// to be buffered or cut and context just ends with the document
+//
+// --------------------------------------------------------------------
+
+typedef struct {
+ hquad    *hq;     // NULL: just the last tokens are kept (bigrams)
+ int       width,flags;
+ int      *ring,mask,num,pos,last;
+ int       batched,batchcells; // batched: 1 yes, 0 not yet, -1 no memory
+ pairbatch b;
+ long long add,err; // pairs, raw corpora never reset them
+}pairwindow;
+
+int pairwindow_new(pairwindow*pw,hquad*hq,int width,int flags)
+{
+ int size=1;
+ memset(pw,0,sizeof(*pw));
+ pw->hq=hq;
+ pw->width=max(1,width);
+ pw->flags=flags;
+ pw->batchcells=pairbatch_max;
+ pw->last=-1;
+ while(size<pw->width)
+  size*=2;
+ pw->mask=size-1;
+ pw->ring=(int*)malloc(size*sizeof(int));
+ return (pw->ring!=NULL);
+}
+
+void pairwindow_flush(pairwindow*pw)
+{
+ if(pw->batched>0)
+  {
+#if defined(W2N_STATS)
+   long long add=pw->add;
+#endif
+   pairbatch_flush(&pw->b,pw->hq,&pw->add,&pw->err);
+   stats_count(pairs,pw->add-add);
   }
- if(filter&filter_punct)
+}
+
+void pairwindow_delete(pairwindow*pw)
+{
+ pairwindow_flush(pw);
+ if(pw->batched>0)
+  pairbatch_delete(&pw->b);
+ free(pw->ring);
+ memset(pw,0,sizeof(*pw));
+}
+
+// end of a document: the next token has no context
+void pairwindow_reset(pairwindow*pw)
+{
+ pairwindow_flush(pw);
+ pw->num=0;
+ pw->last=-1;
+}
+
+// last token read, -1 if none (or if it was not in the dictionary):
+// skipped ones too
+int pairwindow_last(const pairwindow*pw)
+{
+ return pw->last;
+}
+
+// appends id to the window without pairing it (checkpoint_read)
+void pairwindow_push(pairwindow*pw,int id)
+{
+ pw->last=id;
+ pw->ring[pw->pos]=id;
+ pw->pos=(pw->pos+1)&pw->mask;
+ if(pw->num<pw->width)
+  pw->num++;
+}
+
+// a token left out (subsampling): it keeps its place, so distances do
+// not change, but has no pairs; bigrams still see it as the last one
+void pairwindow_skip(pairwindow*pw,int id)
+{
+ pairwindow_push(pw,-1);
+ pw->last=id;
+}
+
+static void pairwindow_set(pairwindow*pw,int x,int y,int value)
+{
+ if(pw->batched>0)
   {
-   if(isutf8)
+   if(pw->b.num==pw->b.max)
+    pairbatch_flush(&pw->b,pw->hq,&pw->add,&pw->err);
+   switch(pairbatch_add(&pw->b,pw->hq,x,y,value))
     {
-     unsigned int state=0,code=0;
-     while(*word)
-      if(decode(&state,&code,(unsigned char)*word))
-       word++;
-      else 
-       if(iswpunct(code))
-        word++;
-       else
-        break;        
+     case 0:  pw->add++;break;
+     case -1: pw->err++;break;
     }
-   else
-    while(*word)
-     if(ispunct((unsigned char)*word))
-      word++;
-     else
-      break;
-   if(*word==0)
-    return 1;           
-  }  
- return 0;
+  }
+ else 
+ if(hquad_set(pw->hq,x,y,value,1)==-1)
+  pw->err++;
+ else
+  pw->add++; 
+}
+
+// pairs id (-1 for a skipped token) with the window, then appends it
+void pairwindow_add(pairwindow*pw,int id)
+{
+ if(pw->hq&&(id!=-1))
+  {
+   int d;
+#if defined(W2N_STATS)
+   long long add=pw->add;
+#endif
+   stats_timer(t);
+   if((pw->batched==0)&&(pw->hq->used>=pairbatch_cells))
+    pw->batched=pairbatch_new(&pw->b,pw->batchcells)?1:-1;
+   for(d=1;d<=pw->num;d++)
+    {
+     int e=pw->ring[(pw->pos-d)&pw->mask];
+     if((e!=-1)&&(e!=id))
+      {
+       int addval=(pw->flags&1)?pw->width-d+1:1;
+       pairwindow_set(pw,e,id,addval);
+       if(d<pw->width)
+        pairwindow_set(pw,id,e,addval);
+      }
+    }
+   stats_elapsed(addcorpus,t);
+   stats_count(pairs,pw->add-add);
+  }
+ pairwindow_push(pw,id);
+}
+
+// pairs of a whole token sequence
+int addcorpus(hquad*hq,int*items,int cnt,int width,int flags,int*perr)
+{
+ pairwindow pw;
+ int        i,add;
+ if(!pairwindow_new(&pw,hq,width,flags))
+  {
+   if(perr) *perr=cnt;
+   return 0;
+  }
+ pw.batchcells=(int)min((size_t)cnt*2*width,(size_t)pairbatch_max);
+ for(i=0;i<cnt;i++)
+  pairwindow_add(&pw,items[i]);
+ pairwindow_flush(&pw);
+ add=(int)pw.add;
+ if(perr) *perr=(int)pw.err;
+ pairwindow_delete(&pw);
+ return add;  
+}
+
+int filter_word(const char*word,int isutf8,int filter)
+{
+ token_info ti;
+ token_classify(&ti,word,isutf8);
+ return token_filtered(&ti,filter);
 }
 
 // --------------------------------------------------------------------
@@ -1314,48 +4091,461 @@ typedef struct{
  tfidf_dict*stop;
  
  hquad     *hq;
+ 
+ const char*checkpoint;
+ int        checkpointevery,resume;
+ 
+ long long  rangestart,rangeend;
+ 
+ float        sample; // -sample threshold, 0 = every token is paired
+ unsigned int seed;   // subsampling random state
 }corpus_analysis;
 
-int corpus_analyze(const char*corpus,corpus_analysis*mode)
+// --------------------------------------------------------------------
+//
+// subsampling
+// as in word2vec, a token with count c out of n corpus tokens is paired
+// with probability (sqrt(c/(t*n))+1)*(t*n)/c, t = -sample: frequent
+// words make fewer couples. A couple count divided by the probabilities
+// of its two words estimates the count without subsampling
+//
+// --------------------------------------------------------------------
+
+static unsigned int subsample_rand(unsigned int*seed)
+{
+ *seed^=*seed<<13;
+ *seed^=*seed>>17;
+ *seed^=*seed<<5;
+ return *seed;
+}
+
+double subsample_keep(const tfidf_dict*dict,int id,float sample)
+{
+ double c=(double)dict->items[id].cnt,tn=(double)sample*(double)dict->lemmas_cnt,p;
+ if((c<=0)||(tn<=0))
+  return 1;
+ p=(sqrt(c/tn)+1)*tn/c;
+ return (p<1)?p:1;
+}
+
+// draws just for words that can be dropped, so the random sequence
+// depends on the corpus only
+int subsample_drop(corpus_analysis*mode,int id)
+{
+ double p=subsample_keep(mode->dict,id,mode->sample);
+ return (p<1)&&(subsample_rand(&mode->seed)>=p*4294967296.0);
+}
+
+// divides every count by the keep probabilities of its row and column
+int subsample_rescale(hquad*hq,const tfidf_dict*dict,float sample)
+{
+ double*keep=(double*)malloc((dict->num+1)*sizeof(double));
+ size_t i;
+ int    x,y,j;
+ if(keep==NULL)
+  return 0;
+ for(i=0;i<dict->num;i++)
+  keep[i]=subsample_keep(dict,(int)i,sample);
+ for(y=0;y<hq->h;y++)
+  for(x=0;x<hq->w;x++)
+   if(hq->q[y][x].items)
+    for(j=0;j<hq->q[y][x].size;j++)
+     {
+      hashquad*c=&hq->q[y][x].items[j];
+      size_t   cy=(size_t)y*hq->size+(c->coord>>16),cx=(size_t)x*hq->size+(c->coord&0xFFFF);
+      if(c->cnt&&(cx<dict->num)&&(cy<dict->num))
+       {
+        double v=(double)c->cnt/(keep[cx]*keep[cy])+0.5;
+        if(v>=(double)hqcount_max)
+         {
+          hqcount_overflow();
+          c->cnt=hqcount_max;
+         }
+        else
+         c->cnt=(hqcount)v;
+       }
+     }
+ free(keep);
+ return 1;
+}
+
+// --------------------------------------------------------------------
+//
+// corpus_resync
+// first document boundary at or after offset: the start of a "# newdoc"
+// or "<doc" line for CoNLL-U, the start of a line for raw text (or the
+// file size if there's none). Every byte range [a,b) of a corpus file
+// is read as [resync(a),resync(b)), so consecutive ranges never share
+// or skip a document.
+//
+// --------------------------------------------------------------------
+
+long long corpus_resync(FILE*f,long long offset,int fileformat)
+{
+ char      line[8192];
+ int       ch,linestart=1;
+ long long size=file_size(f);
+ if(offset>=size)
+  return size;
+ if(offset>0)
+  {
+   // skip the end of the line that holds offset-1
+   file_seek(f,offset-1);
+   while(((ch=fgetc(f))!=EOF)&&(ch!='\n'))
+    ;
+   if(ch==EOF)
+    return size;
+  }
+ else
+  file_seek(f,0);
+ if(fileformat==fileformat_raw)
+  return file_tell(f);
+ while(1)
+  {
+   long long pos=file_tell(f);
+   size_t    l;
+   if(fgets(line,sizeof(line),f)==NULL)
+    return size;
+   if(linestart&&((memcmp(line,"# newdoc",8)==0)||(memcmp(line,"<doc",4)==0)))
+    return pos;
+   l=strlen(line);
+   linestart=(l&&(line[l-1]=='\n'));
+  }
+}
+
+// --------------------------------------------------------------------
+//
+// checkpoint
+// state of a corpus analysis at a document boundary: corpus offset and
+// counters, dictionary items (in id order), raw hquad hash tables and
+// the pair window (raw corpora go on across chunks), so that a resumed
+// run goes on exactly as the interrupted one would have done. Written
+// to <file>.tmp and then renamed over <file>.
+//
+// --------------------------------------------------------------------
+
+typedef struct {
+ long long   offset;
+ int         docs,subdocs;
+ size_t      tokens;
+ pairwindow *window; // its pairs counter is saved too
+}checkpoint_state;
+
+static int checkpoint_fingerprint(corpus_analysis*mode,int*fp)
+{
+ fp[0]=mode->fileformat;
+ fp[1]=mode->format;
+ fp[2]=mode->filter;
+ fp[3]=mode->generating|(mode->ngrams<<4)|((mode->hq!=NULL)<<8);
+ fp[4]=mode->width;
+ fp[5]=mode->addmode;
+ memcpy(&fp[6],&mode->sample,sizeof(int));
+#if defined(W2N_WIDE)
+ // raw hash tables have wide cells
+ fp[7]=sizeof(hqcount);
+ return 8;
+#else
+ return 7;
+#endif
+}
+
+int checkpoint_write(const char*fn,corpus_analysis*mode,checkpoint_state*st)
 {
+ char tmp[1024];
  FILE*f;
+ // pairs still batched in the window go to the hquad first
+ pairwindow_flush(st->window);
+ sprintf(tmp,"%.1000s.tmp",fn);
+ f=fopen(tmp,"wb+");
+ if(f)
+  {
+   int                fp[8],nfp=checkpoint_fingerprint(mode,fp),err=0,x,y;
+   unsigned long long num=mode->dict->num,lemmas=mode->dict->lemmas_cnt,docscnt=mode->dict->docs_cnt,tokens=st->tokens;
+   size_t             i;
+   setvbuf(f,NULL,_IOFBF,4*1024*1024);
+   if(fwrite("W2CK",1,4,f)!=4)                                   err++;
+   if(fwrite(fp,sizeof(int),nfp,f)!=(size_t)nfp)                err++;
+   if(fwrite(&st->offset,sizeof(st->offset),1,f)!=1)            err++;
+   if(fwrite(&st->docs,sizeof(st->docs),1,f)!=1)                err++;
+   if(fwrite(&st->subdocs,sizeof(st->subdocs),1,f)!=1)          err++;
+   if(fwrite(&st->window->add,sizeof(st->window->add),1,f)!=1)  err++;
+   if(fwrite(&tokens,sizeof(tokens),1,f)!=1)                    err++;
+   if(fwrite(&mode->dict->docid,sizeof(mode->dict->docid),1,f)!=1) err++;
+   if(fwrite(&lemmas,sizeof(lemmas),1,f)!=1)                    err++;
+   if(fwrite(&docscnt,sizeof(docscnt),1,f)!=1)                  err++;
+   if(fwrite(&num,sizeof(num),1,f)!=1)                          err++;
+   for(i=0;(i<mode->dict->num)&&(err==0);i++)
+    {
+     tfidf_lemma       *lm=&mode->dict->items[i];
+     int                len=strlen(lm->str);
+     unsigned long long cnt=lm->cnt,doccnt=lm->doccnt;
+     if(fwrite(&len,sizeof(len),1,f)!=1)                        err++;
+     if(fwrite(lm->str,1,len,f)!=(size_t)len)                   err++;
+     if(fwrite(&lm->docid,sizeof(lm->docid),1,f)!=1)            err++;
+     if(fwrite(&cnt,sizeof(cnt),1,f)!=1)                        err++;
+     if(fwrite(&doccnt,sizeof(doccnt),1,f)!=1)                  err++;
+     if(fwrite(&lm->tfidf,sizeof(lm->tfidf),1,f)!=1)            err++;
+    }
+   if(mode->hq)
+    {
+     hquad*hq=mode->hq;
+     if(fwrite(&hq->w,sizeof(hq->w),1,f)!=1)                    err++;
+     if(fwrite(&hq->h,sizeof(hq->h),1,f)!=1)                    err++;
+     if(fwrite(&hq->size,sizeof(hq->size),1,f)!=1)              err++;
+     if(fwrite(&hq->used,sizeof(hq->used),1,f)!=1)              err++;
+     for(y=0;(y<hq->h)&&(err==0);y++)
+      for(x=0;(x<hq->w)&&(err==0);x++)
+       {
+        hashquads*t=&hq->q[y][x];
+        int       size=t->items?t->size:0;
+        if(fwrite(&size,sizeof(size),1,f)!=1)                   err++;
+        if(size)
+         {
+          if(fwrite(&t->num,sizeof(t->num),1,f)!=1)             err++;
+          if(fwrite(t->items,sizeof(t->items[0]),size,f)!=(size_t)size) err++;
+         }
+       }
+    }
+   if(fwrite(&st->window->num,sizeof(st->window->num),1,f)!=1)  err++;
+   for(x=st->window->num;x>0;x--)
+    if(fwrite(&st->window->ring[(st->window->pos-x)&st->window->mask],sizeof(int),1,f)!=1) err++;
+   if(fwrite(&st->window->last,sizeof(st->window->last),1,f)!=1) err++;
+   if(fwrite(&mode->seed,sizeof(mode->seed),1,f)!=1)            err++;
+   if(fflush(f)!=0) err++;
+#if defined(_WIN32)
+   _commit(_fileno(f));
+#else
+   fsync(fileno(f));
+#endif
+   fclose(f);
+   if(err==0)
+    {
+#if defined(_WIN32)
+     if(!MoveFileExA(tmp,fn,MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH))
+      err++;
+#else
+     if(rename(tmp,fn)!=0)
+      err++;
+#endif
+    }
+   if(err)
+    remove(tmp);
+   return (err==0);
+  }
+ else
+  return 0;
+}
+
+// dictionary and hquad in mode have to be just created (or, for the
+// dictionary, imported from the same file used by the interrupted run)
+int checkpoint_read(const char*fn,corpus_analysis*mode,checkpoint_state*st)
+{
+ FILE*f=fopen(fn,"rb");
+ if(f)
+  {
+   char               magic[4],*str=NULL;
+   int                fp[8],cfp[8],nfp=checkpoint_fingerprint(mode,fp),ret=1,x,y,docid,strsize=0;
+   unsigned long long num=0,lemmas=0,docscnt=0,tokens=0,i;
+   tfidf_dict        *h=mode->dict;
+   setvbuf(f,NULL,_IOFBF,4*1024*1024);
+   if((fread(magic,1,4,f)!=4)||(memcmp(magic,"W2CK",4)!=0))     ret=0;
+   else
+   if((fread(cfp,sizeof(int),nfp,f)!=(size_t)nfp)||(memcmp(fp,cfp,nfp*sizeof(int))!=0))
+    {printf("checkpoint (%s) was made with different options\n",fn);ret=0;}
+   else
+   if((fread(&st->offset,sizeof(st->offset),1,f)!=1)||
+      (fread(&st->docs,sizeof(st->docs),1,f)!=1)||
+      (fread(&st->subdocs,sizeof(st->subdocs),1,f)!=1)||
+      (fread(&st->window->add,sizeof(st->window->add),1,f)!=1)||
+      (fread(&tokens,sizeof(tokens),1,f)!=1)||
+      (fread(&docid,sizeof(docid),1,f)!=1)||
+      (fread(&lemmas,sizeof(lemmas),1,f)!=1)||
+      (fread(&docscnt,sizeof(docscnt),1,f)!=1)||
+      (fread(&num,sizeof(num),1,f)!=1))
+    ret=0;
+   st->tokens=(size_t)tokens;
+   if(ret)
+    {
+     // items are added back in id order, so that ids don't change
+     tfidf_dict_reset(h);
+     for(i=0;(i<num)&&ret;i++)
+      {
+       int                len,ldocid;
+       unsigned long long cnt,doccnt;
+       float              tfidf;
+       tfidf_lemma       *lm;
+       if(fread(&len,sizeof(len),1,f)!=1)
+        {ret=0;break;}
+       if(len+1>strsize)
+        {
+         strsize=len+1;
+         str=(char*)realloc(str,strsize);
+        }
+       if((fread(str,1,len,f)!=(size_t)len)||
+          (fread(&ldocid,sizeof(ldocid),1,f)!=1)||
+          (fread(&cnt,sizeof(cnt),1,f)!=1)||
+          (fread(&doccnt,sizeof(doccnt),1,f)!=1)||
+          (fread(&tfidf,sizeof(tfidf),1,f)!=1))
+        {ret=0;break;}
+       str[len]=0;
+       lm=tfidf_dict_add(h,str,ldocid,1);
+       if(lm==NULL)
+        {ret=0;break;}
+       lm->docid=ldocid;
+       lm->cnt=(size_t)cnt;
+       lm->doccnt=(size_t)doccnt;
+       lm->tfidf=tfidf;
+      }
+     free(str);
+     h->docid=docid;
+     h->lemmas_cnt=(size_t)lemmas;
+     h->docs_cnt=(size_t)docscnt;
+    }
+   if(ret&&mode->hq)
+    {
+     hquad         *hq=mode->hq;
+     int            w,hh;
+     hqused         used;
+     unsigned short size;
+     if((fread(&w,sizeof(w),1,f)!=1)||(fread(&hh,sizeof(hh),1,f)!=1)||
+        (fread(&size,sizeof(size),1,f)!=1)||(fread(&used,sizeof(used),1,f)!=1)||
+        (w!=hq->w)||(hh!=hq->h)||(size!=hq->size))
+      ret=0;
+     else
+      hq->used=used;
+     for(y=0;(y<hq->h)&&ret;y++)
+      for(x=0;(x<hq->w)&&ret;x++)
+       {
+        hashquads*t=&hq->q[y][x];
+        int       tsize;
+        if(fread(&tsize,sizeof(tsize),1,f)!=1)
+         ret=0;
+        else
+        if(tsize)
+         {
+          if(t->items) hashquads_delete(t);
+          if(!hashquads_new(t,tsize)||(fread(&t->num,sizeof(t->num),1,f)!=1)||
+             (fread(t->items,sizeof(t->items[0]),tsize,f)!=(size_t)tsize))
+           ret=0;
+         }
+       }
+    }
+   if(ret)
+    {
+     int n,id;
+     if((fread(&n,sizeof(n),1,f)!=1)||(n<0)||(n>st->window->width))
+      ret=0;
+     while(ret&&n--)
+      if(fread(&id,sizeof(id),1,f)!=1)
+       ret=0;
+      else
+       pairwindow_push(st->window,id);
+     if(ret&&((fread(&st->window->last,sizeof(st->window->last),1,f)!=1)||(fread(&mode->seed,sizeof(mode->seed),1,f)!=1)))
+      ret=0;
+    }
+   fclose(f);
+   return ret;
+  }
+ else
+  return 0;
+}
+
+int corpus_analyze(const char*corpus,corpus_analysis*mode)
+{
+ FILE         *f;
+ corpus_stream cs;
+ int           isutf8=0;
  printf("opening %s...\n",corpus);
- f=fopen(corpus,"rb");
+ f=corpus_open(corpus,&cs,&isutf8);
+ if(f&&(cs.kind!=corpus_plain)&&(mode->rangestart||mode->rangeend||mode->checkpoint))
+  {
+   printf("ranges and checkpoints need an uncompressed corpus file\n");
+   corpus_close(f,&cs);
+   return 0;
+  }
  if(f)
   {
    int  docs=0,subdocs=0,llemmas=0;
-   int  itemscnt=16*1024,autocut=4*1024;
-   int *items=(int*)calloc(itemscnt,sizeof(int));
-   int  isutf8=file_checkutf(f),err=0,i=0,add=0;
-   setvbuf(f,NULL,_IOFBF,16*1024*1024);
+   // a document longer than autocut tokens counts as more (dictionary
+   // document counts and checkpoints), its pairs go on across
+   int  autocut=4*1024;
+   int  i=0,lastcheckpoint=0;
+   pairwindow pw;
+   size_t tokens=0;
+   long long begin=(cs.kind==corpus_plain)?file_tell(f):0,stopat=-1;
+   int       empty;
+   if(mode->rangeend>0)
+    stopat=corpus_resync(f,mode->rangeend,mode->fileformat);
+   if(mode->rangestart>0)
+    begin=max(begin,corpus_resync(f,mode->rangestart,mode->fileformat));
+   if((stopat!=-1)||(mode->rangestart>0))
+    printf("range %lld:%lld...\n",begin,stopat);
+   // no document starts in the range: nothing to read (the end of a
+   // range is checked at document boundaries, with file_tell)
+   empty=(stopat!=-1)&&(begin>=stopat);
+   if(cs.kind==corpus_plain)
+    file_seek(f,begin);
+   if(!pairwindow_new(&pw,mode->hq,mode->width,mode->addmode))
+    {
+     corpus_close(f,&cs);
+     return 0;
+    }
+   if(mode->checkpoint&&mode->resume)
+    {
+     checkpoint_state st;
+     st.window=&pw;
+     if(checkpoint_read(mode->checkpoint,mode,&st)&&(file_seek(f,st.offset)==0))
+      {
+       docs=st.docs;subdocs=st.subdocs;tokens=st.tokens;
+       lastcheckpoint=docs+subdocs;
+       printf("resuming from checkpoint (%s) at doc %d, chunk %d...\n",mode->checkpoint,docs,subdocs);
+      }
+     else
+      {
+       printf("can't resume from checkpoint (%s)\n",mode->checkpoint);
+       corpus_close(f,&cs);
+       pairwindow_delete(&pw);
+       return 0;
+      }
+    }
+   // (a decompressed stream has its own buffer, set before its first
+   // read, and a corpus_reader its blocks)
+   if((cs.kind==corpus_plain)&&!cs.reader)
+    setvbuf(f,NULL,_IOFBF,16*1024*1024);
+   token_classinit();
    printf("analyzing...\n",corpus);
-   while((!feof(f))&&(!err))
+   while((!empty)&&(!feof(f))&&(!pw.err))
     {
-     char word[builtin_max_word_len*2],feat[builtin_max_word_len];
+     char       word[builtin_max_word_len*2],feat[builtin_max_word_len];
+     token_info ti;
+     stats_timer(tt);
      if(mode->fileformat==fileformat_raw)
-      read_raw_word(f,word,sizeof(word),feat,sizeof(feat),isutf8);
+      read_raw_word(f,word,sizeof(word),feat,sizeof(feat),isutf8,&ti);
      else 
       read_conllu_word(f,word,sizeof(word),feat,sizeof(feat),isutf8,mode->format,mode->filter>>16);     
+     stats_elapsed(tokenize,tt);
      if((mode->fileformat==fileformat_conllu)&&((*word=='#')||(*word=='<')))
       {
        if((memcmp(word,"# newdoc",8)==0)||(memcmp(word,"# newpar",8)==0)||(memcmp(word,"<doc",4)==0))
         {
-         if(mode->hq)
-          add+=addcorpus(mode->hq,items,i,mode->width,mode->addmode,&err);
+         pairwindow_reset(&pw);
          i=0;
         }
        if((memcmp(word,"# newdoc",8)==0)||(memcmp(word,"<doc",4)==0))
         {         
+         // this is the first document of the next range
+         if((stopat!=-1)&&(file_tell(f)>stopat))
+          break;
          docs++;
          if(mode->hq)
           {
            if((docs%1024)==0)
-            printf("doc: %d corpus couples: %dM     \r",docs,mode->hq->used/(1000*1000));            
-           if(add>50*1000*1000)
+            printf("doc: %d corpus couples: %dM     \r",docs,(int)(mode->hq->used/(1000*1000)));            
+           if(pw.add>50*1000*1000)
             {
              int red=hquad_reduce(mode->hq,1);
-             printf("doc: %d corpus couples: %dM <<  \r",docs,mode->hq->used/(1000*1000));            
-             add=0;
+             printf("doc: %d corpus couples: %dM <<  \r",docs,(int)(mode->hq->used/(1000*1000)));            
+             pw.add=0;
             }
           }  
          else
@@ -1365,62 +4555,106 @@ int corpus_analyze(const char*corpus,corpus_analysis*mode)
           } 
          if((mode->maxdocs!=-1)&&(docs>=mode->maxdocs))
           break;
+         if(mode->checkpoint&&mode->checkpointevery&&(i==0)&&(docs+subdocs-lastcheckpoint>=mode->checkpointevery))
+          {
+           checkpoint_state st={file_tell(f),docs,subdocs,tokens,&pw};
+           if(!checkpoint_write(mode->checkpoint,mode,&st))
+            printf("\ncan't write checkpoint (%s)\n",mode->checkpoint);
+           lastcheckpoint=docs+subdocs;
+          }
         }
       }
      else 
       {
+       int id=-1;
+       stats_timer(tl);
+       if((stopat!=-1)&&(mode->fileformat==fileformat_raw)&&(file_tell(f)>stopat))
+        break;
+       tokens++;
+       if(mode->fileformat!=fileformat_raw)
+        token_classify(&ti,word,isutf8);
        if(*word==0)
-        items[i++]=-1;
+        id=-1;
        else 
-       if(mode->stop&&tfidf_dict_find(mode->stop,word))
-        items[i++]=-1;
+       if(mode->stop&&tfidf_dict_findhash(mode->stop,word,ti.hash))
+        id=-1;
        else 
-       if(mode->filter&&filter_word(word,isutf8,mode->filter))
-        items[i++]=-1;
+       if(mode->filter&&token_filtered(&ti,mode->filter))
+        id=-1;
        else 
         {
          tfidf_lemma*what;
-         if(*feat) {strcat(word,"\t");strcat(word,feat);}
+         if(*feat) 
+          {
+           strcat(word,"\t");strcat(word,feat);
+           ti.hash=string_hashfunct(word);
+          }
          if(mode->generating)
-          what=tfidf_dict_add(mode->dict,word,docs+subdocs,1);         
+          what=tfidf_dict_addhash(mode->dict,word,ti.hash,docs+subdocs,1);         
          else
-          what=tfidf_dict_find(mode->dict,word);         
+          what=tfidf_dict_findhash(mode->dict,word,ti.hash);         
          if(what)
           {
-           items[i]=(what-mode->dict->items);
+           id=(what-mode->dict->items);
            if(mode->ngrams==2)
             {
-             if(i&&(items[i-1]!=-1))
+             int prev=pairwindow_last(&pw);
+             if(prev!=-1)
               {
                char bigram[512];
-               sprintf(bigram,"%s_%s",mode->dict->items[items[i-1]].str,word);
+               sprintf(bigram,"%s_%s",mode->dict->items[prev].str,word);
                if(mode->generating)
                 tfidf_dict_add(mode->dict,bigram,docs+subdocs,1);   
                else 
                 {
                  what=tfidf_dict_find(mode->dict,bigram);         
                  if(what)
-                  items[i]=(what-mode->dict->items);
+                  id=(what-mode->dict->items);
                 }
               }
             } 
           } 
-         else
-          items[i]=-1;
-         i++; 
         }  
+       stats_elapsed(lookup,tl);
+       if((id!=-1)&&(mode->sample>0)&&subsample_drop(mode,id))
+        pairwindow_skip(&pw,id);
+       else
+        pairwindow_add(&pw,id);
+       i++;
        if(autocut&&(i>=autocut))
         {
-         if(mode->hq) 
-          add+=addcorpus(mode->hq,items,i,mode->width,mode->addmode,&err);
          subdocs++;
          i=0;
+         if(mode->checkpoint&&mode->checkpointevery&&(mode->fileformat==fileformat_raw)&&(docs+subdocs-lastcheckpoint>=mode->checkpointevery))
+          {
+           checkpoint_state st={file_tell(f),docs,subdocs,tokens,&pw};
+           if(!checkpoint_write(mode->checkpoint,mode,&st))
+            printf("\ncan't write checkpoint (%s)\n",mode->checkpoint);
+           lastcheckpoint=docs+subdocs;
+          }
         }        
       }  
     }    
+   pairwindow_delete(&pw);
    printf("\nclosing file.\n");
-   fclose(f); 
-   free(items);    
+   if(cs.kind==corpus_plain)
+    w2n_stats.bytes+=file_tell(f)-begin;
+   w2n_stats.tokens+=tokens;
+   w2n_stats.docs+=docs;
+   if(pw.err)
+    {
+     printf("can't add neighborhood counts (out of memory or count overflow)\n");
+     corpus_close(f,&cs);
+     return 0;
+    }
+   // only part of the corpus was read: write nothing
+   if(!corpus_close(f,&cs))
+    {
+     printf("can't read %s to the end\n",corpus);
+     return 0;
+    }
+   if(cs.kind!=corpus_plain)
+    w2n_stats.bytes+=cs.bytes;
    return 1;
   }   
  else
@@ -1429,10 +4663,73 @@ int corpus_analyze(const char*corpus,corpus_analysis*mode)
 
 // --------------------------------------------------------------------
 
-int createneighbors(const char*corpus,const char*dictionary,const char*stops,const char*neighbors,int width,int neighborhoodsize,int filter,int fileformat,int maxdocs,int flags)
-{ 
- corpus_analysis crp;
+int stats_writejson(const char*fn,const char*command,tfidf_dict*dict,hquad*hq)
+{
+ FILE*f=fopen(fn,"wb+");
+ if(f)
+  {
+   double seconds=timer_now()-w2n_stats.time0;
+   size_t used=0,reserved=0;
+   fprintf(f,"{\n");
+   fprintf(f," \"command\": \"%s\",\n",command);
+#if defined(W2N_STATS)
+   fprintf(f," \"instrumented\": true,\n");
+#else
+   fprintf(f," \"instrumented\": false,\n");
+#endif
+   fprintf(f," \"seconds\": %.3f,\n",seconds);
+   fprintf(f," \"corpus_bytes\": %llu,\n",w2n_stats.bytes);
+   fprintf(f," \"tokens\": %llu,\n",w2n_stats.tokens);
+   fprintf(f," \"docs\": %llu,\n",w2n_stats.docs);
+   fprintf(f," \"bytes_per_second\": %.0f,\n",seconds?w2n_stats.bytes/seconds:0);
+   fprintf(f," \"tokens_per_second\": %.0f,\n",seconds?w2n_stats.tokens/seconds:0);
+   fprintf(f," \"peak_rss_bytes\": %llu",(unsigned long long)process_peakrss());
+   if(dict)
+    {
+     memorybag_bytes(&dict->heap,&used,&reserved);
+     fprintf(f,",\n \"dictionary\": {\"items\": %llu, \"heap_used_bytes\": %llu, \"heap_reserved_bytes\": %llu}",(unsigned long long)dict->num,(unsigned long long)used,(unsigned long long)reserved);
+    }
+   if(hq)
+    {
+     unsigned long long slots=0,tiles=0;
+     int                x,y;
+     for(y=0;y<hq->h;y++)
+      for(x=0;x<hq->w;x++)
+       if(hq->q[y][x].items)
+        {tiles++;slots+=hq->q[y][x].size;}
+     fprintf(f,",\n \"hquad\": {\"cells\": %lld, \"tiles\": %llu, \"slots\": %llu, \"slot_bytes\": %llu}",(long long)hq->used,tiles,slots,slots*sizeof(hashquad));
+    }
+#if defined(W2N_STATS)
+   {
+    double tps=(double)(stats_ticks()-w2n_stats.tick0)/(seconds?seconds:1);
+    int    i,last=0;
+    fprintf(f,",\n \"phases_seconds\": {\"tokenize\": %.3f, \"lookup\": %.3f, \"addcorpus\": %.3f, \"hquad_reduce\": %.3f, \"hquad_setreadonlymode\": %.3f, \"write\": %.3f}",
+            w2n_stats.tokenize/tps,w2n_stats.lookup/tps,w2n_stats.addcorpus/tps,w2n_stats.reduce/tps,w2n_stats.readonly/tps,w2n_stats.write/tps);
+    fprintf(f,",\n \"pairs\": %llu,\n \"reductions\": %llu,\n \"hashquads_rehashes\": %llu",w2n_stats.pairs,w2n_stats.reductions,w2n_stats.rehashes);
+    for(i=0;i<18;i++)
+     if(w2n_stats.probes[i])
+      last=i;
+    fprintf(f,",\n \"hashquads_probe_histogram\": {");
+    for(i=0;i<=last;i++)
+     fprintf(f,"%s\"%s%d\": %llu",i?", ":"",(i==17)?">=":"<",(i==0)?1:((i==17)?65536:(1<<i)),w2n_stats.probes[i]);
+    fprintf(f,"}");
+   }
+#endif
+   fprintf(f,"\n}\n");
+   fclose(f);
+   return 1;
+  }
+ else
+  return 0;
+}
+
+// --------------------------------------------------------------------
+
+int createneighbors(const char*corpus,const char*dictionary,const char*stops,const char*neighbors,int width,int neighborhoodsize,int filter,int fileformat,int maxdocs,int flags,float sample,unsigned int seed,const char*stats,const char*checkpoint,int checkpointevery,int resume,long long rangestart,long long rangeend)
+{ 
+ corpus_analysis crp;
  hquad           hq;
+ stats_reset();
  memset(&crp,0,sizeof(crp)); 
  crp.dict=tfidf_dict_new(256*1024,64*1024,1);
  if(crp.dict)
@@ -1465,20 +4762,57 @@ int createneighbors(const char*corpus,const char*dictionary,const char*stops,con
  crp.filter=filter;
  crp.width=width;
  crp.maxdocs=maxdocs;
+ crp.rangestart=rangestart;
+ crp.rangeend=rangeend;
+ if(sample>0)
+  {
+   if(crp.generating||(crp.dict->lemmas_cnt==0))
+    printf("-sample needs a dictionary with counts, ignored\n");
+   else
+    {
+     crp.sample=sample;
+     crp.seed=seed?seed:1;
+    }
+  }
+ if(checkpoint&&*checkpoint)
+  {
+   crp.checkpoint=checkpoint;
+   crp.checkpointevery=checkpointevery;
+   crp.resume=resume;
+  }
  if(corpus_analyze(corpus,&crp))
   {
    int ln=strlen(neighbors),ret;
+   if((crp.sample>0)&&(flags&8))
+    {
+     printf("rescaling subsampled counts...\n");
+     subsample_rescale(crp.hq,crp.dict,crp.sample);
+    }
    printf("optimizing hquad for output...\n");
    hquad_setreadonlymode(crp.hq);     
    printf("\nWriting neighborhoods...\n");     
-   if((ln>4)&&(_strcmpi(neighbors+ln-4,".txt")==0))
-    ret=hquad_writetext(crp.hq,crp.dict,neighbors,neighborhoodsize);
-   else     
-    ret=hquad_writebinary(crp.hq,neighbors);     
+   {
+    stats_timer(t);
+    if((ln>4)&&(_strcmpi(neighbors+ln-4,".txt")==0))
+     ret=hquad_writetext(crp.hq,crp.dict,neighbors,neighborhoodsize);
+    else     
+    if(flags&2)
+     ret=hquad_writecompressed(crp.hq,neighbors);
+    else
+     ret=hquad_writebinary(crp.hq,neighbors);     
+    stats_elapsed(write,t);
+   }
    if(ret)  
-    printf("\ndone.\n");  
+    {
+     printf("\ndone.\n");  
+     if(crp.checkpoint)
+      remove(crp.checkpoint);
+    } 
    else
     printf("can't write output file\n");     
+   if(stats&&*stats)
+    if(!stats_writejson(stats,"neighborhood",crp.dict,crp.hq))
+     printf("can't write stats file (%s)\n",stats);
    if(crp.hq)   hquad_delete(crp.hq);
    if(crp.dict) tfidf_dict_delete(crp.dict);
    if(crp.stop) tfidf_dict_delete(crp.stop);   
@@ -1493,9 +4827,10 @@ int createneighbors(const char*corpus,const char*dictionary,const char*stops,con
 
 // --------------------------------------------------------------------
 
-int createdictionary(const char*corpus,const char*dictionary,const char*stops,int filter,int fileformat,int maxdocs,int flags,int emit,int sortway)
+int createdictionary(const char*corpus,const char*dictionary,const char*stops,int filter,int fileformat,int maxdocs,int flags,int emit,int sortway,const char*stats,long long rangestart,long long rangeend)
 {
  corpus_analysis crp;
+ stats_reset();
  memset(&crp,0,sizeof(crp));
  crp.dict=tfidf_dict_new(256*1024,64*1024,1);
  if(!crp.dict)
@@ -1512,6 +4847,8 @@ int createdictionary(const char*corpus,const char*dictionary,const char*stops,in
  crp.ngrams=1+((flags&1)==1);
  crp.filter=filter;
  crp.maxdocs=maxdocs;
+ crp.rangestart=rangestart;
+ crp.rangeend=rangeend;
  if(corpus_analyze(corpus,&crp))
   {
    int hm;
@@ -1524,8 +4861,26 @@ int createdictionary(const char*corpus,const char*dictionary,const char*stops,in
     tfidf_dict_sort(crp.dict,tfidf_dict_tfidfcompare); 
 
    printf("exporting dictionary file (%s)...\n",dictionary);
-   hm=tfidf_dict_export(crp.dict,dictionary,emit,2,1);
+   {
+    stats_timer(t);
+    // a range is just a part of the corpus: cuts are applied when merging
+    if(rangestart||rangeend)
+     {
+      hm=tfidf_dict_export(crp.dict,dictionary,emit,0,0);
+      tfidf_dict_exportcut(crp.dict,dictionary,emit,0,0);
+     }
+    else
+     {
+      hm=tfidf_dict_export(crp.dict,dictionary,emit,2,1);
+      if(!tfidf_dict_exportcut(crp.dict,dictionary,emit,2,1))
+       printf("can't write cut lemmas file (%s.cut)\n",dictionary);
+     }
+    stats_elapsed(write,t);
+   }
    printf("Dictionary has %d elements (over cut limits)\n",hm);
+   if(stats&&*stats)
+    if(!stats_writejson(stats,"dictionary",crp.dict,NULL))
+     printf("can't write stats file (%s)\n",stats);
    
    if(crp.dict) tfidf_dict_delete(crp.dict);
    if(crp.stop) tfidf_dict_delete(crp.stop);
@@ -1539,6 +4894,298 @@ int createdictionary(const char*corpus,const char*dictionary,const char*stops,in
   }  
 }
 
+// --------------------------------------------------------------------
+//
+// update
+// adds a new corpus file to an existing dictionary (that has to carry
+// count and doccount columns) and to its binary neighborhood: old counts
+// are loaded, only the new documents are read, then tf*idf, sorting and
+// cuts are applied again and neighborhood ids are remapped to the new
+// dictionary order
+//
+// --------------------------------------------------------------------
+
+int updatecorpus(const char*corpus,const char*dictionary,const char*stops,const char*neighbors,int width,int filter,int fileformat,int maxdocs,int flags,int emit,int sortway,const char*stats)
+{
+ corpus_analysis crp;
+ hquad           hq,nhq;
+ int             ln=strlen(neighbors),*remap,hm=0,ret=0;
+ size_t          i;
+ stats_reset();
+ if((ln>4)&&(_strcmpi(neighbors+ln-4,".txt")==0))
+  {
+   printf("update needs a binary neighborhood file\n");
+   return 0;
+  }
+ memset(&crp,0,sizeof(crp));
+ crp.dict=tfidf_dict_new(256*1024,64*1024,1);
+ if(!crp.dict)
+  return 0; 
+ printf("reading dictionary file (%s)...\n",dictionary);
+ if((tfidf_dict_import(crp.dict,dictionary)==0)||(crp.dict->lemmas_cnt==0)||(crp.dict->docs_cnt==0))
+  {
+   printf("dictionary file (%s) not found or without count/doccount (-emit 3)\n",dictionary);
+   tfidf_dict_delete(crp.dict);
+   return 0;
+  }
+ // lemmas cut from the dictionary go on counting from their old counts
+ if(tfidf_dict_addcut(crp.dict,dictionary))
+  printf("reading cut lemmas file (%s.cut)...\n",dictionary);
+ // new documents have to count as new for every lemma
+ for(i=0;i<crp.dict->num;i++)
+  crp.dict->items[i].docid=-1;
+ crp.dict->docid=-1;
+ hquad_new(&hq,8192,2*1024*1024,2*1024*1024);
+ printf("reading neighborhood file (%s)...\n",neighbors);
+ if(!hquad_addbinary(&hq,neighbors))
+  {
+   printf("can't read neighborhood file (%s)\n",neighbors);
+   hquad_delete(&hq);
+   tfidf_dict_delete(crp.dict);
+   return 0;
+  }
+ crp.hq=&hq;
+ if(stops&&*stops)
+  {
+   printf("reading stopwords file (%s)...\n",stops);
+   crp.stop=tfidf_dict_new(8192,1024,1);
+   if(crp.stop) tfidf_dict_import(crp.stop,stops);
+  }     
+ crp.fileformat=fileformat&0xFF; 
+ crp.format=fileformat>>8; 
+ crp.generating=1;
+ crp.ngrams=1+((flags&1)==1);
+ crp.filter=filter;
+ crp.width=width;
+ crp.maxdocs=maxdocs;
+ if(corpus_analyze(corpus,&crp))
+  {
+   size_t num=crp.dict->num;
+   tfidf_dict_settfidf(crp.dict);
+   // docid keeps the id used in hq while sorting
+   for(i=0;i<num;i++)
+    crp.dict->items[i].docid=(int)i;
+   if(sortway==0)
+    tfidf_dict_sort(crp.dict,tfidf_dict_stringcompare);
+   else
+    tfidf_dict_sort(crp.dict,tfidf_dict_tfidfcompare); 
+   remap=(int*)malloc(num*sizeof(int));
+   for(i=0;i<num;i++)
+    if(tfidf_dict_exportable(crp.dict,i,2,1))
+     remap[crp.dict->items[i].docid]=hm++;
+    else
+     remap[crp.dict->items[i].docid]=-1;
+   
+   printf("remapping neighborhood...\n");
+   hquad_new(&nhq,8192,max(hm,1),max(hm,1));
+   hquad_remap(&hq,&nhq,remap,num);
+   hquad_delete(&hq);
+   free(remap);
+   hquad_setreadonlymode(&nhq);
+   
+   printf("exporting dictionary file (%s)...\n",dictionary);
+   printf("writing neighborhood file (%s)...\n",neighbors);
+   {
+    stats_timer(t);
+    ret=(tfidf_dict_export(crp.dict,dictionary,emit,2,1)==hm)&&tfidf_dict_exportcut(crp.dict,dictionary,emit,2,1)&&((flags&2)?hquad_writecompressed(&nhq,neighbors):hquad_writebinary(&nhq,neighbors));
+    stats_elapsed(write,t);
+   }
+   if(ret)
+    printf("Dictionary has %d elements (over cut limits)\ndone.\n",hm);
+   else
+    printf("can't write output files\n");
+   if(stats&&*stats)
+    if(!stats_writejson(stats,"update",crp.dict,&nhq))
+     printf("can't write stats file (%s)\n",stats);
+   hquad_delete(&nhq);
+  }
+ else
+  {
+   printf("can't read corpus file.\n");
+   hquad_delete(&hq);
+  }
+ if(crp.dict) tfidf_dict_delete(crp.dict);
+ if(crp.stop) tfidf_dict_delete(crp.stop);
+ return ret;
+}
+
+// --------------------------------------------------------------------
+//
+// merge
+// sums N (dictionary, binary neighborhood) couples built on different
+// corpus shards: the dictionaries are unified (counts added, tf*idf,
+// sort and cuts applied again), each neighborhood is translated to the
+// unified ids - one at a time, in a temporary file, unless its ids are
+// already the same - and then all of them are merged tile by tile.
+// A dictionary listed more than once (shards built with the same one)
+// is counted once; without neighborhoods just dictionaries are merged.
+//
+// --------------------------------------------------------------------
+
+int mergefiles(const char**dicts,const char**neighbors,int n,const char*dictionary,const char*neighborsout,int cut,int flags,int emit,int sortway)
+{
+ tfidf_dict *dict=tfidf_dict_new(256*1024,64*1024,1);
+ int        **remaps=(int**)calloc(n,sizeof(int*));
+ size_t      *remapsizes=(size_t*)calloc(n,sizeof(size_t)),i,lemmas_cnt=0,docs_cnt=0;
+ const char **bins=(const char**)calloc(n,sizeof(char*));
+ char       **tmps=(char**)calloc(n,sizeof(char*));
+ int         *final=NULL,k,hm=0,ret=1;
+ size_t       cntcut=cut?2:0,doccntcut=cut?1:0;
+ stats_reset();
+ for(k=0;(k<n)&&ret;k++)
+  {
+   tfidf_dict*shard;
+   int        same;
+   for(same=0;same<k;same++)
+    if(strcmp(dicts[same],dicts[k])==0)
+     break;
+   if(same<k)
+    {
+     remapsizes[k]=remapsizes[same];
+     remaps[k]=(int*)malloc(remapsizes[k]*sizeof(int));
+     memcpy(remaps[k],remaps[same],remapsizes[k]*sizeof(int));
+     continue;
+    }
+   shard=tfidf_dict_new(256*1024,64*1024,1);
+   printf("reading dictionary file (%s)...\n",dicts[k]);
+   if(shard&&tfidf_dict_import(shard,dicts[k])&&shard->lemmas_cnt&&shard->docs_cnt)
+    {
+     remapsizes[k]=shard->num;
+     remaps[k]=(int*)malloc(shard->num*sizeof(int));
+     for(i=0;i<shard->num;i++)
+      {
+       tfidf_lemma*lm=tfidf_dict_find(dict,shard->items[i].str);
+       if(lm==NULL)
+        {
+         lm=tfidf_dict_add(dict,shard->items[i].str,0,0);
+         lm->cnt=lm->doccnt=0;
+        }
+       lm->cnt+=shard->items[i].cnt;
+       lm->doccnt+=shard->items[i].doccnt;
+       remaps[k][i]=(int)(lm-dict->items);
+      }
+     // cut lemmas only count: they have no neighborhood rows
+     tfidf_dict_addcut(dict,dicts[k]);
+     lemmas_cnt+=shard->lemmas_cnt;
+     docs_cnt+=shard->docs_cnt;
+    }
+   else
+    {
+     printf("dictionary file (%s) not found or without count/doccount (-emit 3)\n",dicts[k]);
+     ret=0;
+    }
+   if(shard) tfidf_dict_delete(shard);
+  }
+ if(ret&&dict->num)
+  {
+   size_t num=dict->num;
+   dict->lemmas_cnt=lemmas_cnt;
+   dict->docs_cnt=docs_cnt;
+   tfidf_dict_settfidf(dict);
+   for(i=0;i<num;i++)
+    dict->items[i].docid=(int)i;
+   if(sortway==0)
+    tfidf_dict_sort(dict,tfidf_dict_stringcompare);
+   else
+    tfidf_dict_sort(dict,tfidf_dict_tfidfcompare); 
+   final=(int*)malloc(num*sizeof(int));
+   for(i=0;i<num;i++)
+    if(tfidf_dict_exportable(dict,i,cntcut,doccntcut))
+     final[dict->items[i].docid]=hm++;
+    else
+     final[dict->items[i].docid]=-1;
+   for(k=0;k<n;k++)
+    for(i=0;i<remapsizes[k];i++)
+     remaps[k][i]=final[remaps[k][i]];
+   free(final);
+   
+   for(k=0;(k<n)&&ret&&neighbors;k++)
+    {
+     hquad        hq,nhq;
+     hquad_stream st;
+     int          identity=(remapsizes[k]==(size_t)hm);
+     hquad_new(&nhq,8192,max(hm,1),max(hm,1));
+     for(i=0;(i<remapsizes[k])&&identity;i++)
+      if(remaps[k][i]!=(int)i)
+       identity=0;
+     if(identity&&hquad_stream_open(&st,neighbors[k]))
+      {
+       identity=(st.w==nhq.w)&&(st.h==nhq.h)&&(st.size==nhq.size);
+       hquad_stream_close(&st);
+      }
+     else
+      identity=0;
+     if(identity)
+      bins[k]=neighbors[k];
+     else
+      {
+       printf("remapping neighborhood file (%s)...\n",neighbors[k]);
+       memset(&hq,0,sizeof(hq));
+       tmps[k]=(char*)malloc(strlen(neighborsout)+32);
+       sprintf(tmps[k],"%s.%d.tmp",neighborsout,k);
+       if(hquad_readbinary(&hq,neighbors[k])&&hquad_remap(&hq,&nhq,remaps[k],remapsizes[k]))
+        {
+         hquad_setreadonlymode(&nhq);
+         if(!hquad_writebinary(&nhq,tmps[k]))
+          {printf("can't write temporary file (%s)\n",tmps[k]);ret=0;}
+        }
+       else
+        {printf("can't read neighborhood file (%s)\n",neighbors[k]);ret=0;}
+       hquad_delete(&hq);
+       bins[k]=tmps[k];
+      }
+     hquad_delete(&nhq);
+    }
+   if(ret&&neighbors)
+    {
+     printf("merging neighborhoods (%s)...\n",neighborsout);
+     {
+      stats_timer(t);
+      if(flags&2)
+       {
+        // merged as HQUA first, then packed row by row
+        char *tmp=(char*)malloc(strlen(neighborsout)+32);
+        hquad mhq;
+        sprintf(tmp,"%s.hqua.tmp",neighborsout);
+        ret=hquad_mergebinary(bins,n,tmp)&&hquad_readbinary(&mhq,tmp);
+        if(ret)
+         {
+          ret=hquad_writecompressed(&mhq,neighborsout);
+          hquad_delete(&mhq);
+         }
+        remove(tmp);
+        free(tmp);
+       }
+      else
+       ret=hquad_mergebinary(bins,n,neighborsout);
+      stats_elapsed(write,t);
+     }
+    }
+   if(ret)
+    {
+     printf("exporting dictionary file (%s)...\n",dictionary);
+     ret=(tfidf_dict_export(dict,dictionary,emit,cntcut,doccntcut)==hm)&&tfidf_dict_exportcut(dict,dictionary,emit,cntcut,doccntcut);
+     if(ret)
+      printf("Dictionary has %d elements\ndone.\n",hm);
+     else
+      printf("can't write output files\n");
+    }
+  }
+ else
+  ret=0;
+ for(k=0;k<n;k++)
+  {
+   if(tmps[k])   {remove(tmps[k]);free(tmps[k]);}
+   if(remaps[k]) free(remaps[k]);
+  }
+ free(tmps);
+ free(bins);
+ free(remaps);
+ free(remapsizes);
+ tfidf_dict_delete(dict);
+ return ret;
+}
+
 // --------------------------------------------------------------------
 
 float row_distance(tfidf_dict*d,int*wordrow,size_t wordrowcnt,int*checkrow,size_t checkrowcnt,size_t*same)
@@ -1551,14 +5198,14 @@ float row_distance(tfidf_dict*d,int*wordrow,size_t wordrowcnt,int*checkrow,size_
    while((w<wordrowcnt)&&(wordrow[w*2]<checkrow[c*2]))
     {dist+=(avg * avg) * (1/d->items[wordrow[w*2]].tfidf);w++;cnt++;}
    while((c<checkrowcnt)&&(checkrow[c*2]<wordrow[w*2]))
-    {if(0) dist+=(avg * avg) * (1/d->items[checkrow[c*2]].tfidf);c++;cnt++;}
+    {c++;cnt++;}
    while((w<wordrowcnt)&&(c<checkrowcnt)&&(wordrow[w*2]==checkrow[c*2]))
     {sdist+=(((float)wordrow[w*2+1]/(float)d->items[wordrow[w*2]].cnt)-((float)checkrow[c*2+1]/(float)d->items[checkrow[c*2]].cnt)) * (((float)wordrow[w*2+1]/(float)d->items[wordrow[w*2]].cnt)-((float)checkrow[c*2+1]/(float)d->items[checkrow[c*2]].cnt)) * (1/d->items[wordrow[w*2]].tfidf);w++;c++;cnt++;scnt++;}
   }
  while(w<wordrowcnt)
   {dist+=(avg * avg) * (1/d->items[wordrow[w*2]].tfidf);w++;cnt++;}
  while(c<checkrowcnt)
-  {if(0) dist+=(avg * avg) * (1/d->items[checkrow[c*2]].tfidf);c++;cnt++;}
+  {c++;cnt++;}
  if(same) *same=scnt;
  return sqrtf(dist+sdist); 
 }
@@ -1582,119 +5229,1714 @@ float row_distanceshare(size_t dsize,int*wordrow,size_t wordrowcnt,int*checkrow,
   return dist; 
 }
 
-typedef struct{
- int   id;
- float score;
-}best;
+// --------------------------------------------------------------------
+//
+// row kernels
+// same metrics as row_distance/row_distanceshare, but working on rows
+// split in id/count arrays (sorted by id) and on dense per-lemma weights
+// so that the merge can skip non matching blocks with SIMD compares and
+// never has to touch tfidf_lemma records
+//
+// --------------------------------------------------------------------
 
-void best_reset(best*b,int hm)
-{ 
- int i;
- for(i=0;i<hm;i++)
-  {b[i].id=-1;b[i].score=0;}
+typedef struct {
+ size_t num;
+ float *invcnt;
+ float *invtfidf;
+}row_weights;
+
+int row_weights_new(row_weights*rw,tfidf_dict*d)
+{
+ size_t i;
+ rw->num=d->num;
+ rw->invcnt=(float*)malloc((rw->num+1)*sizeof(float));
+ rw->invtfidf=(float*)malloc((rw->num+1)*sizeof(float));
+ if((rw->invcnt==NULL)||(rw->invtfidf==NULL))
+  {
+   free(rw->invcnt);free(rw->invtfidf);
+   rw->invcnt=rw->invtfidf=NULL;
+   return 0;
+  }
+ for(i=0;i<rw->num;i++)
+  {
+   rw->invcnt[i]=1/(float)d->items[i].cnt;
+   rw->invtfidf[i]=1/d->items[i].tfidf;
+  }
+ return 1;
 }
 
-void best_add(best*b,int hm,int id,float score,int way)
+void row_weights_delete(row_weights*rw)
 {
- int i=hm;
- while(i--)
-  if(b[i].id==-1)
-   if(i&&((b[i-1].id==-1)||((way==-1)&&(b[i-1].score>score))||((way==1)&&(b[i-1].score<score))))
-    continue;
-   else
-    {
-     b[i].id=id;
-     b[i].score=score;
-     break;
-    } 
-  else
-  if(i&&(((way==-1)&&(b[i-1].score>score))||((way==1)&&(b[i-1].score<score))))
-   continue;
-  else
+ free(rw->invcnt);
+ free(rw->invtfidf);
+}
+
+typedef struct {
+ size_t        num,size;
+ int          *ids;
+ int          *cnts;
+ float        *wgts;
+ double        wsum;
+ unsigned int *match;
+ int           id;   // row id and norm, set by row_metric_prepare
+ float         norm;
+}split_row;
+
+int split_row_new(split_row*r,size_t size)
+{
+ r->num=0;
+ r->size=size;
+ r->ids=(int*)malloc((size+1)*sizeof(int));
+ r->cnts=(int*)malloc((size+1)*sizeof(int));
+ r->wgts=(float*)malloc((size+1)*sizeof(float));
+ r->match=(unsigned int*)malloc((size+1)*2*sizeof(unsigned int));
+ return (r->ids&&r->cnts&&r->wgts&&r->match);
+}
+
+void split_row_delete(split_row*r)
+{
+ free(r->ids);
+ free(r->cnts);
+ free(r->wgts);
+ free(r->match);
+}
+
+// row must be sorted by id (see id_compare); weights are needed only
+// for the row used as first argument of row_distancefast
+void split_row_set(split_row*r,const int*row,size_t cnt,const row_weights*rw)
+{
+ size_t i;
+ if(cnt>r->size) cnt=r->size;
+ for(i=0;i<cnt;i++)
+  {
+   r->ids[i]=row[i*2];
+   r->cnts[i]=row[i*2+1];
+  }
+ if(rw)
+  {
+   float avg=0.5;
+   r->wsum=0;
+   for(i=0;i<cnt;i++)
+    r->wsum+=(r->wgts[i]=(avg * avg) * rw->invtfidf[r->ids[i]]);
+  }
+ r->num=cnt;
+}
+
+static int bit_ctz(unsigned int v)
+{
+#if defined(_MSC_VER)
+ unsigned long i;
+ _BitScanForward(&i,v);
+ return (int)i;
+#else
+ return __builtin_ctz(v);
+#endif
+}
+
+// sorted set intersection: returns how many ids a and b share, and
+// their positions (ascending) in ia/ib
+size_t rowkernel_intersect(const int*a,size_t na,const int*b,size_t nb,unsigned int*ia,unsigned int*ib)
+{
+ size_t i=0,j=0,m=0;
+#if defined(W2N_AVX2)
+ {
+  const __m256i rot=_mm256_set_epi32(0,7,6,5,4,3,2,1);
+  while((i+8<=na)&&(j+8<=nb))
    {
-    if(i!=hm-1)
+    __m256i va=_mm256_loadu_si256((const __m256i*)(a+i));
+    __m256i vb=_mm256_loadu_si256((const __m256i*)(b+j)),vr=vb;
+    __m256i eq=_mm256_cmpeq_epi32(va,vb);
+    int     amax=a[i+7],bmax=b[j+7],k;
+    unsigned int mask;
+    for(k=1;k<8;k++)
      {
-      int j=hm-1;
-      while(j>i)
-       {
-        b[j].id=b[j-1].id;
-        b[j].score=b[j-1].score;
-        j--;
-       }
-      b[i].id=id;
-      b[i].score=score;
-     } 
-    break; 
-   } 
+      vr=_mm256_permutevar8x32_epi32(vr,rot);
+      eq=_mm256_or_si256(eq,_mm256_cmpeq_epi32(va,vr));
+     }
+    mask=(unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(eq));
+    while(mask)
+     {
+      int x=bit_ctz(mask);
+      mask&=mask-1;
+      ia[m]=(unsigned int)(i+x);
+      ib[m]=(unsigned int)(j+bit_ctz((unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_set1_epi32(a[i+x]),vb)))));
+      m++;
+     }
+    if(amax<=bmax) i+=8;
+    if(bmax<=amax) j+=8;
+   }
+ }
+#endif
+#if defined(W2N_SSE2)
+ while((i+4<=na)&&(j+4<=nb))
+  {
+   __m128i va=_mm_loadu_si128((const __m128i*)(a+i));
+   __m128i vb=_mm_loadu_si128((const __m128i*)(b+j));
+   __m128i eq=_mm_cmpeq_epi32(va,vb);
+   int     amax=a[i+3],bmax=b[j+3];
+   unsigned int mask;
+   eq=_mm_or_si128(eq,_mm_cmpeq_epi32(va,_mm_shuffle_epi32(vb,_MM_SHUFFLE(0,3,2,1))));
+   eq=_mm_or_si128(eq,_mm_cmpeq_epi32(va,_mm_shuffle_epi32(vb,_MM_SHUFFLE(1,0,3,2))));
+   eq=_mm_or_si128(eq,_mm_cmpeq_epi32(va,_mm_shuffle_epi32(vb,_MM_SHUFFLE(2,1,0,3))));
+   mask=(unsigned int)_mm_movemask_ps(_mm_castsi128_ps(eq));
+   while(mask)
+    {
+     int x=bit_ctz(mask);
+     mask&=mask-1;
+     ia[m]=(unsigned int)(i+x);
+     ib[m]=(unsigned int)(j+bit_ctz((unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_set1_epi32(a[i+x]),vb)))));
+     m++;
+    }
+   if(amax<=bmax) i+=4;
+   if(bmax<=amax) j+=4;
+  }
+#endif
+ // branchless merge for what's left
+ while((i<na)&&(j<nb))
+  {
+   int x=a[i],y=b[j];
+   ia[m]=(unsigned int)i;
+   ib[m]=(unsigned int)j;
+   m+=(x==y);
+   i+=(x<=y);
+   j+=(y<=x);
+  }
+ return m;
+}
+
+// equivalent to row_distance (word must be set with weights)
+float row_distancefast(const row_weights*rw,const split_row*word,const split_row*check,size_t*same)
+{
+ const unsigned int*iw=word->match,*ic=word->match+word->size;
+ size_t             m=rowkernel_intersect(word->ids,word->num,check->ids,check->num,word->match,word->match+word->size);
+ size_t             w=0,k;
+ float              sdist=0,dist=0;
+ if(isfinite(word->wsum))
+  {
+   // non shared items weight = whole row weight - shared items weight
+   double shared=0;
+   for(k=0;k<m;k++)
+    {
+     int   id=word->ids[iw[k]];
+     float inv=rw->invcnt[id];
+     float dif=((float)word->cnts[iw[k]]*inv)-((float)check->cnts[ic[k]]*inv);
+     shared+=word->wgts[iw[k]];
+     sdist+=dif * dif * rw->invtfidf[id];
+    }
+   dist=(float)(word->wsum-shared);
+  }
+ else
+  {
+   for(k=0;k<m;k++)
+    {
+     int   id=word->ids[iw[k]];
+     float inv=rw->invcnt[id];
+     float dif=((float)word->cnts[iw[k]]*inv)-((float)check->cnts[ic[k]]*inv);
+     while(w<iw[k])
+      dist+=word->wgts[w++];
+     w++;
+     sdist+=dif * dif * rw->invtfidf[id];
+    }
+   while(w<word->num)
+    dist+=word->wgts[w++];
+  }
+ if(same) *same=m;
+ return sqrtf(dist+sdist);
+}
+
+// equivalent to row_distanceshare
+float row_distancesharefast(const split_row*word,const split_row*check)
+{
+ const unsigned int*iw=word->match,*ic=word->match+word->size;
+ size_t             m=rowkernel_intersect(word->ids,word->num,check->ids,check->num,word->match,word->match+word->size);
+ size_t             k;
+ float              dist=0;
+ for(k=0;k<m;k++)
+  dist+=(check->cnts[ic[k]]*word->cnts[iw[k]]);
+ if(dist)
+  return sqrtf(dist);
+ else
+  return dist;
+}
+
+// --------------------------------------------------------------------
+//
+// row metrics
+// -metric picks the kernel once, so the query loop has no per element
+// branching and a new metric costs nothing to the others; what a kernel
+// needs beyond the two rows (row norms, ppmi margins) is precomputed
+// for the whole neighborhood when the metric is set up
+//
+// --------------------------------------------------------------------
+
+#define metric_distance   W2N_METRIC_DISTANCE   // weighted euclidean (lower is better)
+#define metric_share      W2N_METRIC_SHARE      // sqrt of the shared counts products
+#define metric_cosine     W2N_METRIC_COSINE
+#define metric_jaccard    W2N_METRIC_JACCARD    // shared items / items of both rows
+#define metric_ppmicosine W2N_METRIC_PPMICOSINE // cosine of the PPMI weighted rows
+
+typedef struct row_metric row_metric;
+typedef float (*row_kernel)(const row_weights*rw,const row_metric*rm,const split_row*word,const split_row*check);
+
+struct row_metric {
+ int        metric,way; // way: -1 lower is better, 1 higher is better
+ row_kernel kernel;
+ float     *norm;       // rows cut to area (cosine, ppmi cosine)
+ float     *logrow,*logcol;
+ double     logtotal;
+};
+
+const char*metric_names[]={"distance","share","cosine","jaccard","ppmi"};
+
+int metric_fromname(const char*name)
+{
+ int i;
+ for(i=0;i<(int)(sizeof(metric_names)/sizeof(metric_names[0]));i++)
+  if(strcmp(name,metric_names[i])==0)
+   return i;
+ return -1;
+}
+
+// row and column count sums (and the longest row) of a read only hquad
+int hquad_margins(hquad*hq,double*rowsum,double*colsum,double*total,size_t*maxrow)
+{
+ int x,y;
+ *total=0;
+ *maxrow=0;
+ if(hq->cdata)
+  {
+   int*row=(int*)malloc(((size_t)hq->cmaxrow+1)*2*sizeof(int));
+   if(row==NULL)
+    return 0;
+   for(y=0;y<hq->crows;y++)
+    {
+     size_t n=hquad_getreadonlyrow(hq,y,row,-1),i;
+     for(i=0;i<n;i++)
+      {
+       rowsum[y]+=row[i*2+1];
+       colsum[row[i*2]]+=row[i*2+1];
+       *total+=row[i*2+1];
+      }
+     if(n>*maxrow)
+      *maxrow=n;
+    }
+   free(row);
+  }
+ else
+  {
+   int*rowlen=(int*)calloc((size_t)hq->h*hq->size+1,sizeof(int));
+   if(rowlen==NULL)
+    return 0;
+   for(y=0;y<hq->h;y++)
+    for(x=0;x<hq->w;x++)
+     if(hq->q[y][x].items)
+      {
+       int j;
+       for(j=0;j<hq->q[y][x].num;j++)
+        {
+         size_t ry=(size_t)y*hq->size+(hq->q[y][x].items[j].coord>>16);
+         size_t rx=(size_t)x*hq->size+(hq->q[y][x].items[j].coord&0xFFFF);
+         rowsum[ry]+=hq->q[y][x].items[j].cnt;
+         colsum[rx]+=hq->q[y][x].items[j].cnt;
+         *total+=hq->q[y][x].items[j].cnt;
+         if(++rowlen[ry]>(int)*maxrow)
+          *maxrow=rowlen[ry];
+        }
+      }
+   free(rowlen);
+  }
+ return 1;
+}
+
+static float metric_ppmi(const row_metric*rm,int y,int x,int cnt)
+{
+ return fmaxf(0,logf((float)cnt)+(float)rm->logtotal-rm->logrow[y]-rm->logcol[x]);
+}
+
+static float kernel_distance(const row_weights*rw,const row_metric*rm,const split_row*word,const split_row*check)
+{
+ return row_distancefast(rw,word,check,NULL);
+}
+
+static float kernel_share(const row_weights*rw,const row_metric*rm,const split_row*word,const split_row*check)
+{
+ return row_distancesharefast(word,check);
+}
+
+static float kernel_cosine(const row_weights*rw,const row_metric*rm,const split_row*word,const split_row*check)
+{
+ const unsigned int*iw=word->match,*ic=word->match+word->size;
+ size_t             m=rowkernel_intersect(word->ids,word->num,check->ids,check->num,word->match,word->match+word->size),k;
+ float              dot=0,den=word->norm*check->norm;
+ for(k=0;k<m;k++)
+  dot+=(float)word->cnts[iw[k]]*(float)check->cnts[ic[k]];
+ return (den>0)?dot/den:0;
+}
+
+static float kernel_jaccard(const row_weights*rw,const row_metric*rm,const split_row*word,const split_row*check)
+{
+ size_t m=rowkernel_intersect(word->ids,word->num,check->ids,check->num,word->match,word->match+word->size);
+ size_t all=word->num+check->num-m;
+ return all?(float)m/(float)all:0;
+}
+
+// word->wgts hold the word ppmi values (see row_metric_prepare)
+static float kernel_ppmicosine(const row_weights*rw,const row_metric*rm,const split_row*word,const split_row*check)
+{
+ const unsigned int*iw=word->match,*ic=word->match+word->size;
+ size_t             m=rowkernel_intersect(word->ids,word->num,check->ids,check->num,word->match,word->match+word->size),k;
+ float              dot=0,den=word->norm*check->norm;
+ for(k=0;k<m;k++)
+  dot+=word->wgts[iw[k]]*metric_ppmi(rm,check->id,check->ids[ic[k]],check->cnts[ic[k]]);
+ return (den>0)?dot/den:0;
+}
+
+void row_metric_delete(row_metric*rm)
+{
+ free(rm->norm);
+ free(rm->logrow);
+ free(rm->logcol);
+ memset(rm,0,sizeof(row_metric));
+}
+
+// rows are cut to area as the query cuts them; norms are needed for
+// rows 0..num-1 (the dictionary items)
+int row_metric_new(row_metric*rm,int metric,hquad*hq,int num,int area)
+{
+ static const row_kernel kernels[]={kernel_distance,kernel_share,kernel_cosine,kernel_jaccard,kernel_ppmicosine};
+ memset(rm,0,sizeof(row_metric));
+ if((metric<0)||(metric>metric_ppmicosine))
+  return 0;
+ rm->metric=metric;
+ rm->kernel=kernels[metric];
+ rm->way=(metric==metric_distance)?-1:1;
+ if(metric==metric_ppmicosine)
+  {
+   size_t  rows=(size_t)hq->h*hq->size,cols=(size_t)hq->w*hq->size,maxrow,i;
+   double *rowsum=(double*)calloc(rows+1,sizeof(double)),*colsum=(double*)calloc(cols+1,sizeof(double)),total=0;
+   int     ok=rowsum&&colsum&&hquad_margins(hq,rowsum,colsum,&total,&maxrow);
+   rm->logrow=(float*)malloc((rows+1)*sizeof(float));
+   rm->logcol=(float*)malloc((cols+1)*sizeof(float));
+   if(ok&&rm->logrow&&rm->logcol)
+    {
+     // empty rows and columns never take part in a match
+     for(i=0;i<rows;i++)
+      rm->logrow[i]=(rowsum[i]>0)?(float)log(rowsum[i]):0;
+     for(i=0;i<cols;i++)
+      rm->logcol[i]=(colsum[i]>0)?(float)log(colsum[i]):0;
+     rm->logtotal=(total>0)?log(total):0;
+    }
+   else
+    ok=0;
+   free(rowsum);
+   free(colsum);
+   if(!ok)
+    {
+     row_metric_delete(rm);
+     return 0;
+    }
+  }
+ if((metric==metric_cosine)||(metric==metric_ppmicosine))
+  {
+   int *row=(int*)malloc(((size_t)area+1)*2*sizeof(int));
+   int  y;
+   rm->norm=(float*)malloc(((size_t)num+1)*sizeof(float));
+   if((row==NULL)||(rm->norm==NULL))
+    {
+     free(row);
+     row_metric_delete(rm);
+     return 0;
+    }
+   for(y=0;y<num;y++)
+    {
+     size_t cnt=hquad_getreadonlyrow(hq,y,row,area),i;
+     double sum=0;
+     for(i=0;i<cnt;i++)
+      {
+       float v=(metric==metric_cosine)?(float)row[i*2+1]:metric_ppmi(rm,y,row[i*2],row[i*2+1]);
+       sum+=v*v;
+      }
+     rm->norm[y]=(float)sqrt(sum);
+    }
+   free(row);
+  }
+ return 1;
+}
+
+// after split_row_set: row y of the matrix, word is the query side row
+void row_metric_prepare(const row_metric*rm,split_row*r,int y,int word)
+{
+ r->id=y;
+ r->norm=rm->norm?rm->norm[y]:0;
+ if(word&&(rm->metric==metric_ppmicosine))
+  {
+   size_t i;
+   for(i=0;i<r->num;i++)
+    r->wgts[i]=metric_ppmi(rm,y,r->ids[i],r->cnts[i]);
+  }
+}
+
+// checks the row kernels against row_distance/row_distanceshare on
+// random rows - returns the number of mismatches
+int rowkernel_selftest(int rounds)
+{
+ int        errs=0,r,ndict=20000;
+ tfidf_dict*d=tfidf_dict_new(ndict,1024,1);
+ int       *wordrow=(int*)malloc(ndict*2*sizeof(int)),*checkrow=(int*)malloc(ndict*2*sizeof(int));
+ split_row  ws,cs;
+ row_weights rw;
+ int        ok=(d!=NULL)&&(wordrow!=NULL)&&(checkrow!=NULL);
+ memset(&rw,0,sizeof(rw));
+ // both rows are always allocated, so that they can always be deleted
+ ok&=split_row_new(&ws,ndict)&split_row_new(&cs,ndict);
+ if(ok)
+  {
+   srand(1);
+   for(r=0;(r<ndict)&&ok;r++)
+    {
+     char        name[32];
+     tfidf_lemma*lm;
+     sprintf(name,"w%d",r);
+     lm=tfidf_dict_add(d,name,1,1);
+     if(lm)
+      {
+       lm->cnt=1+rand()%5000;
+       lm->tfidf=0.0001f+(float)(rand()%10000)/20000.0f;
+      }
+     else
+      ok=0;
+    }
+   ok=ok&&row_weights_new(&rw,d);
+  }
+ if(!ok)
+  {
+   printf("row kernels selftest: out of memory\n");
+   errs=1;
+  }
+ for(r=0;ok&&(r<rounds);r++)
+  {
+   size_t wcnt=0,ccnt=0,same1,same2;
+   int    id,span=1+rand()%ndict,wden=1+rand()%8,cden=1+rand()%8;
+   float  d1,d2,s1,s2;
+   for(id=0;id<span;id++)
+    {
+     if((rand()%wden)==0) {wordrow[wcnt*2]=id;wordrow[wcnt*2+1]=1+rand()%300;wcnt++;}
+     if((rand()%cden)==0) {checkrow[ccnt*2]=id;checkrow[ccnt*2+1]=1+rand()%300;ccnt++;}
+    }
+   split_row_set(&ws,wordrow,wcnt,&rw);
+   split_row_set(&cs,checkrow,ccnt,NULL);
+   d1=row_distance(d,wordrow,wcnt,checkrow,ccnt,&same1);
+   d2=row_distancefast(&rw,&ws,&cs,&same2);
+   s1=row_distanceshare(d->num,wordrow,wcnt,checkrow,ccnt);
+   s2=row_distancesharefast(&ws,&cs);
+   if((same1!=same2)||(fabs(d1-d2)>1e-5*fabs(d1)+1e-6)||(s1!=s2))
+    {
+     if(errs<8)
+      printf("row kernel mismatch (%d/%d items): distance %f vs %f, same %d vs %d, share %f vs %f\n",(int)wcnt,(int)ccnt,d1,d2,(int)same1,(int)same2,s1,s2);
+     errs++;
+    }
+   {
+    // cosine and jaccard kernels against a plain merge
+    double dot=0,nw=0,nc=0,c1,j1;
+    size_t i,j,shared=0;
+    float  c2,j2;
+    for(i=0;i<wcnt;i++) nw+=(double)wordrow[i*2+1]*wordrow[i*2+1];
+    for(j=0;j<ccnt;j++) nc+=(double)checkrow[j*2+1]*checkrow[j*2+1];
+    for(i=j=0;(i<wcnt)&&(j<ccnt);)
+     if(wordrow[i*2]<checkrow[j*2]) i++;
+     else
+     if(checkrow[j*2]<wordrow[i*2]) j++;
+     else
+      {dot+=(double)wordrow[i*2+1]*checkrow[j*2+1];shared++;i++;j++;}
+    ws.norm=(float)sqrt(nw);
+    cs.norm=(float)sqrt(nc);
+    c1=(nw&&nc)?dot/(sqrt(nw)*sqrt(nc)):0;
+    j1=(wcnt+ccnt-shared)?(double)shared/(wcnt+ccnt-shared):0;
+    c2=kernel_cosine(&rw,NULL,&ws,&cs);
+    j2=kernel_jaccard(&rw,NULL,&ws,&cs);
+    if((fabs(c1-c2)>1e-4*fabs(c1)+1e-6)||(fabs(j1-j2)>1e-6))
+     {
+      if(errs<8)
+       printf("row kernel mismatch (%d/%d items): cosine %f vs %f, jaccard %f vs %f\n",(int)wcnt,(int)ccnt,c1,c2,j1,j2);
+      errs++;
+     }
+   }
+  }
+ row_weights_delete(&rw);
+ split_row_delete(&ws);
+ split_row_delete(&cs);
+ free(wordrow);free(checkrow);
+ if(d) tfidf_dict_delete(d);
+ return errs;
+}
+
+// --------------------------------------------------------------------
+//
+// dense_vectors
+// fixed dimension float vectors, one for each dictionary item, stored
+// as a single contiguous matrix
+// binary file is "HEMB", num, dim and then num*dim floats
+//
+// --------------------------------------------------------------------
+
+typedef struct {
+ int    num,dim;
+ float *items;
+}dense_vectors;
+
+int dense_vectors_new(dense_vectors*dv,int num,int dim)
+{
+ dv->num=num;
+ dv->dim=dim;
+ dv->items=(float*)calloc((size_t)num*dim+1,sizeof(float));
+ return (dv->items!=NULL);
+}
+
+void dense_vectors_delete(dense_vectors*dv)
+{
+ free(dv->items);
+ dv->items=NULL;
+ dv->num=dv->dim=0;
+}
+
+int dense_vectors_writebinary(dense_vectors*dv,const char*bin)
+{
+ FILE*f=fopen(bin,"wb+");
+ if(f)
+  {
+   int    err=0;
+   size_t hm=(size_t)dv->num*dv->dim;
+   if(fwrite("HEMB",1,4,f)!=4)                                 err++;
+   if(fwrite(&dv->num,1,sizeof(dv->num),f)!=sizeof(dv->num))   err++;
+   if(fwrite(&dv->dim,1,sizeof(dv->dim),f)!=sizeof(dv->dim))   err++;
+   if(fwrite(dv->items,sizeof(float),hm,f)!=hm)                err++;
+   fclose(f);
+   return (err==0);
+  }
+ else
+  return 0;
+}
+
+int dense_vectors_readbinary(dense_vectors*dv,const char*bin)
+{
+ FILE*f=fopen(bin,"rb");
+ if(f)
+  {
+   char magic[4];
+   int  ret=0,num,dim;
+   if((fread(magic,1,4,f)==4)&&(memcmp(magic,"HEMB",4)==0))
+    if((fread(&num,1,sizeof(num),f)==sizeof(num))&&(fread(&dim,1,sizeof(dim),f)==sizeof(dim)))
+     if((num>=0)&&(dim>0)&&dense_vectors_new(dv,num,dim))
+      {
+       size_t hm=(size_t)num*dim;
+       if(fread(dv->items,sizeof(float),hm,f)==hm)
+        ret=1;
+       else
+        dense_vectors_delete(dv);
+      }
+   fclose(f);
+   return ret;
+  }
+ else
+  return 0;
+}
+
+float vector_dot(const float*a,const float*b,int dim)
+{
+ int   i=0;
+ float dot=0;
+#if defined(W2N_AVX)
+ {
+  __m256 acc=_mm256_setzero_ps();
+  float  part[8];
+  for(;i+8<=dim;i+=8)
+   acc=_mm256_add_ps(acc,_mm256_mul_ps(_mm256_loadu_ps(a+i),_mm256_loadu_ps(b+i)));
+  _mm256_storeu_ps(part,acc);
+  dot=part[0]+part[1]+part[2]+part[3]+part[4]+part[5]+part[6]+part[7];
+ }
+#elif defined(W2N_SSE2)
+ {
+  __m128 acc=_mm_setzero_ps();
+  float  part[4];
+  for(;i+4<=dim;i+=4)
+   acc=_mm_add_ps(acc,_mm_mul_ps(_mm_loadu_ps(a+i),_mm_loadu_ps(b+i)));
+  _mm_storeu_ps(part,acc);
+  dot=part[0]+part[1]+part[2]+part[3];
+ }
+#endif
+ for(;i<dim;i++)
+  dot+=a[i]*b[i];
+ return dot;
+}
+
+// --------------------------------------------------------------------
+//
+// quantized_vectors
+// dense vectors stored as int8 components plus a per vector scale
+// binary file (meant to be memory mapped) is a 32 bytes header
+// ("HQ8V", num, dim, stride), num float scales and num*stride int8
+// components, both 32 bytes aligned (stride is dim rounded up to 32)
+//
+// --------------------------------------------------------------------
+
+typedef struct {
+ int                num,dim,stride;
+ const float       *scale;
+ const signed char *items;
+ mapped_file        map;
+}quantized_vectors;
+
+#define quantized_align(n) ((((n)+31)/32)*32)
+
+int quantized_vectors_writebinary(dense_vectors*dv,const char*bin)
+{
+ FILE*f=fopen(bin,"wb+");
+ if(f)
+  {
+   int          header[8],i,j,err=0,stride=quantized_align(dv->dim);
+   size_t       scalebytes=quantized_align((size_t)dv->num*sizeof(float));
+   float       *scale=(float*)calloc(scalebytes/sizeof(float)+1,sizeof(float));
+   signed char *q=(signed char*)calloc(stride,1);
+   if((scale==NULL)||(q==NULL))
+    err++;
+   else
+    {
+     memset(header,0,sizeof(header));
+     memcpy(header,"HQ8V",4);
+     header[1]=dv->num;
+     header[2]=dv->dim;
+     header[3]=stride;
+     for(i=0;i<dv->num;i++)
+      {
+       const float*v=dv->items+(size_t)i*dv->dim;
+       float       maxabs=0;
+       for(j=0;j<dv->dim;j++)
+        if(fabs(v[j])>maxabs)
+         maxabs=(float)fabs(v[j]);
+       scale[i]=maxabs/127;
+      }
+     if(fwrite(header,1,sizeof(header),f)!=sizeof(header)) err++;
+     if(fwrite(scale,1,scalebytes,f)!=scalebytes)          err++;
+     for(i=0;(i<dv->num)&&(err==0);i++)
+      {
+       const float*v=dv->items+(size_t)i*dv->dim;
+       for(j=0;j<dv->dim;j++)
+        if(scale[i]>0)
+         {
+          long c=lrintf(v[j]/scale[i]);
+          q[j]=(signed char)((c>127)?127:((c<-127)?-127:c));
+         }
+        else
+         q[j]=0;
+       if(fwrite(q,1,stride,f)!=(size_t)stride) err++;
+      }
+    }
+   free(scale);
+   free(q);
+   fclose(f);
+   return (err==0);
+  }
+ else
+  return 0;
+}
+
+int quantized_vectors_open(quantized_vectors*qv,const char*bin)
+{
+ memset(qv,0,sizeof(*qv));
+ if(mapped_file_open(&qv->map,bin))
+  {
+   const int*header=(const int*)qv->map.data;
+   if((qv->map.size>=32)&&(memcmp(header,"HQ8V",4)==0)&&(header[1]>=0)&&(header[2]>0)&&(header[3]==quantized_align(header[2])))
+    {
+     size_t scalebytes=quantized_align((size_t)header[1]*sizeof(float));
+     if(qv->map.size>=32+scalebytes+(size_t)header[1]*header[3])
+      {
+       qv->num=header[1];
+       qv->dim=header[2];
+       qv->stride=header[3];
+       qv->scale=(const float*)(qv->map.data+32);
+       qv->items=(const signed char*)(qv->map.data+32+scalebytes);
+       return 1;
+      }
+    }
+   mapped_file_close(&qv->map);
+  }
+ return 0;
+}
+
+void quantized_vectors_close(quantized_vectors*qv)
+{
+ mapped_file_close(&qv->map);
+ memset(qv,0,sizeof(*qv));
+}
+
+// stride has to be a multiple of 32
+int vector_dot_int8(const signed char*a,const signed char*b,int stride)
+{
+ int i=0,dot=0;
+#if defined(W2N_AVX2)
+ {
+  __m256i acc=_mm256_setzero_si256();
+  __m128i part;
+  for(;i+32<=stride;i+=32)
+   {
+    __m256i va=_mm256_loadu_si256((const __m256i*)(a+i));
+    __m256i vb=_mm256_loadu_si256((const __m256i*)(b+i));
+    acc=_mm256_add_epi32(acc,_mm256_madd_epi16(_mm256_cvtepi8_epi16(_mm256_castsi256_si128(va)),_mm256_cvtepi8_epi16(_mm256_castsi256_si128(vb))));
+    acc=_mm256_add_epi32(acc,_mm256_madd_epi16(_mm256_cvtepi8_epi16(_mm256_extracti128_si256(va,1)),_mm256_cvtepi8_epi16(_mm256_extracti128_si256(vb,1))));
+   }
+  part=_mm_add_epi32(_mm256_castsi256_si128(acc),_mm256_extracti128_si256(acc,1));
+  part=_mm_add_epi32(part,_mm_shuffle_epi32(part,_MM_SHUFFLE(1,0,3,2)));
+  part=_mm_add_epi32(part,_mm_shuffle_epi32(part,_MM_SHUFFLE(2,3,0,1)));
+  dot=_mm_cvtsi128_si32(part);
+ }
+#elif defined(W2N_SSE2)
+ {
+  __m128i acc=_mm_setzero_si128();
+  for(;i+16<=stride;i+=16)
+   {
+    __m128i va=_mm_loadu_si128((const __m128i*)(a+i));
+    __m128i vb=_mm_loadu_si128((const __m128i*)(b+i));
+    acc=_mm_add_epi32(acc,_mm_madd_epi16(_mm_srai_epi16(_mm_unpacklo_epi8(va,va),8),_mm_srai_epi16(_mm_unpacklo_epi8(vb,vb),8)));
+    acc=_mm_add_epi32(acc,_mm_madd_epi16(_mm_srai_epi16(_mm_unpackhi_epi8(va,va),8),_mm_srai_epi16(_mm_unpackhi_epi8(vb,vb),8)));
+   }
+  acc=_mm_add_epi32(acc,_mm_shuffle_epi32(acc,_MM_SHUFFLE(1,0,3,2)));
+  acc=_mm_add_epi32(acc,_mm_shuffle_epi32(acc,_MM_SHUFFLE(2,3,0,1)));
+  dot=_mm_cvtsi128_si32(acc);
+ }
+#endif
+ for(;i<stride;i++)
+  dot+=a[i]*b[i];
+ return dot;
+}
+
+float quantized_vectors_score(quantized_vectors*qv,int a,int b)
+{
+ int dot=vector_dot_int8(qv->items+(size_t)a*qv->stride,qv->items+(size_t)b*qv->stride,qv->stride);
+ return (float)dot*qv->scale[a]*qv->scale[b];
+}
+
+int createquantized(const char*vectors,const char*quantized)
+{
+ dense_vectors dv;
+ int           ret=0;
+ printf("reading vectors file (%s)...\n",vectors);
+ if(dense_vectors_readbinary(&dv,vectors))
+  {
+   printf("writing quantized vectors file (%s)...\n",quantized);
+   ret=quantized_vectors_writebinary(&dv,quantized);
+   if(ret)
+    printf("done.\n");
+   else
+    printf("can't write quantized vectors file\n");
+   dense_vectors_delete(&dv);
+  }
+ else
+  printf("can't read vectors file\n");
+ return ret;
+}
+
+// --------------------------------------------------------------------
+//
+// embeddings
+// each neighborhood row is PPMI weighted and then reduced to <dim>
+// floats with a sparse random projection: column x contributes to
+// <nonzeros> hashed positions with a hashed sign - vectors are then
+// normalized, so dot product = cosine similarity
+//
+// --------------------------------------------------------------------
+
+typedef struct {
+ hquad         *hq;
+ dense_vectors *dv;
+ double        *rowsum,*colsum,total;
+ size_t         maxrow;
+ int            nonzeros;
+ int            failed; // only set to 1, read once parallel_run returned
+}embedding_job;
+
+static void embedding_rows(void*ctx,int thread,int threads)
+{
+ embedding_job*e=(embedding_job*)ctx;
+ int          *row=(int*)malloc((e->maxrow+1)*2*sizeof(int));
+ int           y,dim=e->dv->dim;
+ if(row==NULL)
+  {
+   // rows of this thread would stay zero vectors
+   e->failed=1;
+   return;
+  }
+ for(y=thread;y<e->dv->num;y+=threads)
+  {
+   float *v=e->dv->items+(size_t)y*dim;
+   size_t cnt=hquad_getreadonlyrow(e->hq,y,row,-1),i;
+   double norm=0;
+   int    k;
+   for(i=0;i<cnt;i++)
+    {
+     int    x=row[i*2];
+     double pmi=log((double)row[i*2+1]*e->total/(e->rowsum[y]*e->colsum[x]));
+     if(pmi>0)
+      for(k=0;k<e->nonzeros;k++)
+       {
+        unsigned int h=hashquadfunct((unsigned int)x*e->nonzeros+k+1);
+        if(h&0x80000000)
+         v[h%dim]-=(float)pmi;
+        else
+         v[h%dim]+=(float)pmi;
+       }
+    }
+   for(k=0;k<dim;k++)
+    norm+=v[k]*v[k];
+   if(norm>0)
+    {
+     float scale=(float)(1/sqrt(norm));
+     for(k=0;k<dim;k++)
+      v[k]*=scale;
+    }
+   if((thread==0)&&((y%(1024*threads))==0))
+    printf("rows: %d   \r",y);
+  }
+ free(row);
+}
+
+int hquad_embed(hquad*hq,dense_vectors*dv,int threads)
+{
+ size_t        rows=(size_t)hq->h*hq->size,cols=(size_t)hq->w*hq->size;
+ embedding_job e;
+ memset(&e,0,sizeof(e));
+ e.hq=hq;
+ e.dv=dv;
+ e.nonzeros=4;
+ e.rowsum=(double*)calloc(rows+1,sizeof(double));
+ e.colsum=(double*)calloc(cols+1,sizeof(double));
+ if((e.rowsum==NULL)||(e.colsum==NULL)||!hquad_margins(hq,e.rowsum,e.colsum,&e.total,&e.maxrow))
+  {
+   free(e.rowsum);free(e.colsum);
+   return 0;
+  }
+ parallel_run(threads,embedding_rows,&e);
+ free(e.rowsum);
+ free(e.colsum);
+ return !e.failed;
+}
+
+int createembeddings(const char*dictionary,const char*neighbors,const char*vectors,int dim,int threads)
+{
+ int        ret=0;
+ tfidf_dict*dict=tfidf_dict_new(256*1024,64*1024,1);
+ if(dict)
+  {
+   printf("reading dictionary (%s)...\n",dictionary);
+   if(tfidf_dict_import(dict,dictionary))
+    {
+     hquad hq;
+     printf("reading neighborhood binary file (%s)...\n",neighbors);
+     if(hquad_readbinary(&hq,neighbors))
+      {
+       dense_vectors dv;
+       if(dense_vectors_new(&dv,dict->num,dim))
+        {
+         printf("projecting %d rows to %d dimensions (%d threads)...\n",dv.num,dv.dim,threads);
+         if(hquad_embed(&hq,&dv,threads))
+          {
+           printf("\nwriting vectors file (%s)...\n",vectors);
+           ret=dense_vectors_writebinary(&dv,vectors);
+           if(ret)
+            printf("done.\n");
+           else
+            printf("can't write vectors file\n");
+          }
+         else
+          printf("\nnot enough memory, vectors file not written\n");
+         dense_vectors_delete(&dv);
+        }
+       else
+        printf("not enough memory\n");
+       hquad_delete(&hq);
+      }
+     else
+      printf("can't read neighborhood (binary) file\n");
+    }
+   else
+    printf("can't read dictionary file\n");
+   tfidf_dict_delete(dict);
+  }
+ return ret;
+}
+
+typedef w2n_result best;
+
+void best_reset(best*b,int hm)
+{ 
+ int i;
+ for(i=0;i<hm;i++)
+  {b[i].id=-1;b[i].score=0;}
+}
+
+void best_add(best*b,int hm,int id,float score,int way)
+{
+ int i=hm;
+ while(i--)
+  if(b[i].id==-1)
+   if(i&&((b[i-1].id==-1)||((way==-1)&&(b[i-1].score>score))||((way==1)&&(b[i-1].score<score))))
+    continue;
+   else
+    {
+     b[i].id=id;
+     b[i].score=score;
+     break;
+    } 
+  else
+  if(i&&(((way==-1)&&(b[i-1].score>score))||((way==1)&&(b[i-1].score<score))))
+   continue;
+  else
+   {
+    if(i!=hm-1)
+     {
+      int j=hm-1;
+      while(j>i)
+       {
+        b[j].id=b[j-1].id;
+        b[j].score=b[j-1].score;
+        j--;
+       }
+      b[i].id=id;
+      b[i].score=score;
+     }
+    else
+    if(((way==-1)&&(b[i].score>score))||((way==1)&&(b[i].score<score)))
+     {
+      b[i].id=id;
+      b[i].score=score;
+     }
+    break;
+   }
+}
+
+void best_print(tfidf_dict*dict,best*b,int hm)
+{
+ int  y;
+ char sbuf[tfidf_dict_maxstr];
+ printf("Similar to: ");
+ for(y=0;y<hm;y++)
+  if(b[y].id!=-1)
+   { 
+    if(y) printf(", ");               
+    printf("%s (%.2f)",tfidf_dict_string(dict,b[y].id,sbuf),b[y].score);  
+   } 
+  else
+   break; 
+ printf("\n");  
+}
+
+// --------------------------------------------------------------------
+//
+// similar
+// top K nearest words for the whole dictionary, computed offline with
+// the query metric; word rows are taken in blocks, so that every check
+// row is split once per block and compared with all the block words
+// while it is still in cache
+// binary file is "HSIM", num, k, metric (metric_* value), area,
+// three zero ints and then num*k best records (id -1 when missing), so
+// the neighbours of word id are the k records at 32+id*k*8
+//
+// --------------------------------------------------------------------
+
+#define similar_block      64
+#define similar_headersize 32
+
+typedef struct {
+ row_weights  *rw;
+ row_metric   *rm;
+ const int    *rows;  // rows sorted by id, row y is rows+2*start[y]
+ const size_t *start;
+ best         *out;
+ int           num,k,area,blocks;
+ int           failed; // only set to 1, read once parallel_run returned
+}similar_job;
+
+static void similar_rows(void*ctx,int thread,int threads)
+{
+ similar_job*s=(similar_job*)ctx;
+ split_row   ws[similar_block],cs;
+ int         b,i,ok=split_row_new(&cs,s->area);
+ for(i=0;i<similar_block;i++)
+  ok&=split_row_new(&ws[i],s->area);
+ if(!ok)
+  s->failed=1;
+ else
+  for(b=thread;b<s->blocks;b+=threads)
+   {
+    int first=b*similar_block,last=min(first+similar_block,s->num),y;
+    for(i=first;i<last;i++)
+     {
+      split_row_set(&ws[i-first],s->rows+2*s->start[i],s->start[i+1]-s->start[i],s->rw);
+      row_metric_prepare(s->rm,&ws[i-first],i,1);
+      best_reset(s->out+(size_t)i*s->k,s->k);
+     }
+    for(y=0;y<s->num;y++)
+     if(s->start[y+1]>s->start[y])
+      {
+       split_row_set(&cs,s->rows+2*s->start[y],s->start[y+1]-s->start[y],NULL);
+       row_metric_prepare(s->rm,&cs,y,0);
+       for(i=first;i<last;i++)
+        if(i!=y)
+         best_add(s->out+(size_t)i*s->k,s->k,y,s->rm->kernel(s->rw,s->rm,&ws[i-first],&cs),s->rm->way);
+      }
+    if(thread==0)
+     printf("rows: %d   \r",first);
+   }
+ for(i=0;i<similar_block;i++)
+  split_row_delete(&ws[i]);
+ split_row_delete(&cs);
+}
+
+int similar_writebinary(const char*fn,const best*out,int num,int k,int metric,int area)
+{
+ FILE*f=fopen(fn,"wb+");
+ if(f)
+  {
+   int    header[8],err=0;
+   size_t hm=(size_t)num*k;
+   memset(header,0,sizeof(header));
+   memcpy(header,"HSIM",4);
+   header[1]=num;
+   header[2]=k;
+   header[3]=metric;
+   header[4]=area;
+   if(fwrite(header,1,sizeof(header),f)!=sizeof(header)) err++;
+   if(fwrite(out,sizeof(best),hm,f)!=hm)                 err++;
+   fclose(f);
+   return (err==0);
+  }
+ else
+  return 0;
+}
+
+typedef struct {
+ int         num,k,metric,area;
+ const best *items;
+ mapped_file map;
+}similar_table;
+
+int similar_table_open(similar_table*st,const char*fn)
+{
+ memset(st,0,sizeof(*st));
+ if(mapped_file_open(&st->map,fn))
+  {
+   const int*header=(const int*)st->map.data;
+   if((st->map.size>=similar_headersize)&&(memcmp(header,"HSIM",4)==0)&&(header[1]>=0)&&(header[2]>0))
+    if(st->map.size>=similar_headersize+(size_t)header[1]*header[2]*sizeof(best))
+     {
+      st->num=header[1];
+      st->k=header[2];
+      st->metric=header[3];
+      st->area=header[4];
+      st->items=(const best*)(st->map.data+similar_headersize);
+      return 1;
+     }
+   mapped_file_close(&st->map);
+  }
+ return 0;
+}
+
+void similar_table_close(similar_table*st)
+{
+ mapped_file_close(&st->map);
+ memset(st,0,sizeof(*st));
+}
+
+// neighbours of id (k records, best first)
+const best*similar_table_get(similar_table*st,int id)
+{
+ if((id>=0)&&(id<st->num))
+  return st->items+(size_t)id*st->k;
+ else
+  return NULL;
+}
+
+int createsimilar(const char*dictionary,const char*neighbors,const char*similar,int area,int k,int metric,int threads)
+{
+ int        ret=0;
+ tfidf_dict*dict=tfidf_dict_new(256*1024,64*1024,1);
+ if(dict)
+  {
+   printf("reading dictionary (%s)...\n",dictionary);
+   if(tfidf_dict_import(dict,dictionary))
+    {
+     hquad hq;
+     printf("reading neighborhood binary file (%s)...\n",neighbors);
+     if(hquad_readbinary(&hq,neighbors))
+      {
+       similar_job s;
+       row_weights rw;
+       row_metric  rm;
+       int        *row=(int*)malloc((size_t)area*2*sizeof(int)),*rows=NULL;
+       size_t     *start=(size_t*)malloc((dict->num+1)*sizeof(size_t)),size=0;
+       int         y,err=0;
+       memset(&s,0,sizeof(s));
+       memset(&rm,0,sizeof(rm));
+       if(row&&start&&row_weights_new(&rw,dict))
+        {
+         // all rows, cut to area and sorted by id as the query sorts them
+         start[0]=0;
+         for(y=0;(y<(int)dict->num)&&(err==0);y++)
+          {
+           size_t cnt=hquad_getreadonlyrow(&hq,y,row,area);
+           qsort(row,cnt,sizeof(int)*2,id_compare);
+           if(start[y]+cnt>size)
+            {
+             size_t nsize=max(size*2,start[y]+cnt+64*1024);
+             int   *nrows=(int*)realloc(rows,nsize*2*sizeof(int));
+             if(nrows==NULL)
+              err++;
+             else
+              {rows=nrows;size=nsize;}
+            }
+           if(err==0)
+            {
+             memcpy(rows+2*start[y],row,cnt*2*sizeof(int));
+             start[y+1]=start[y]+cnt;
+            }
+          }
+         s.rw=&rw;
+         s.rm=&rm;
+         s.rows=rows;
+         s.start=start;
+         s.num=(int)dict->num;
+         s.k=k;
+         s.area=area;
+         s.blocks=(s.num+similar_block-1)/similar_block;
+         if((err==0)&&row_metric_new(&rm,metric,&hq,s.num,area))
+          s.out=(best*)malloc(((size_t)s.num*k+1)*sizeof(best));
+         if(s.out)
+          {
+           printf("top %d of %d rows (%s, %d threads)...\n",k,s.num,metric_names[metric],threads);
+           parallel_run(threads,similar_rows,&s);
+           if(s.failed)
+            printf("\nnot enough memory, similar file not written\n");
+           else
+            {
+             printf("\nwriting similar file (%s)...\n",similar);
+             ret=similar_writebinary(similar,s.out,s.num,k,metric,area);
+             if(ret)
+              printf("done.\n");
+             else
+              printf("can't write similar file\n");
+            }
+           free(s.out);
+          }
+         else
+          printf("not enough memory\n");
+         row_metric_delete(&rm);
+         row_weights_delete(&rw);
+        }
+       else
+        printf("not enough memory\n");
+       free(rows);
+       free(start);
+       free(row);
+       hquad_delete(&hq);
+      }
+     else
+      printf("can't read neighborhood (binary) file\n");
+    }
+   else
+    printf("can't read dictionary file\n");
+   tfidf_dict_delete(dict);
+  }
+ return ret;
+}
+
+// --------------------------------------------------------------------
+//
+// show engine
+// words shared by the rows of all the query terms, ranked by summed
+// count: rows are filtered (count>1), sorted by id and intersected
+// starting from the shortest one, so a query costs the length of its
+// rows, never the dictionary size. Buffers only grow, and are reused
+// from a query to the next
+//
+// --------------------------------------------------------------------
+
+typedef struct {
+ int    *terms;  // term ids
+ int    *rows;   // term rows, id/count couples, row t at rows+2*start[t]
+ size_t *start;
+ int    *res;    // id/summed count couples
+ size_t  termsize,startsize,rowsize,ressize;
+ int     num;
+}show_engine;
+
+void show_engine_delete(show_engine*e)
+{
+ free(e->terms);
+ free(e->rows);
+ free(e->start);
+ free(e->res);
+ memset(e,0,sizeof(show_engine));
+}
+
+static int show_engine_grow(void**p,size_t*size,size_t need,size_t itemsize)
+{
+ if(need>*size)
+  {
+   size_t nsize=max(need,*size*2);
+   void  *np=realloc(*p,nsize*itemsize);
+   if(np==NULL)
+    return 0;
+   *p=np;
+   *size=nsize;
+  }
+ return 1;
+}
+
+int show_engine_addterm(show_engine*e,int id)
+{
+ if(!show_engine_grow((void**)&e->terms,&e->termsize,e->num+1,sizeof(int)))
+  return 0;
+ if(!show_engine_grow((void**)&e->start,&e->startsize,e->num+2,sizeof(size_t)))
+  return 0;
+ e->terms[e->num++]=id;
+ return 1;
+}
+
+static int show_compare(const void*a,const void*b)
+{
+ const int*A=(const int*)a,*B=(const int*)b;
+ if(A[1]!=B[1])
+  return (B[1]>A[1])?1:-1;
+ else
+  return A[0]-B[0];
+}
+
+// returns the number of id/count couples in e->res (best first, at most
+// topk if topk>0), -1 if out of memory; terms are reset for the next query
+int show_engine_run(show_engine*e,hquad*hq,int area,int topk)
+{
+ size_t n;
+ int    t,shortest=0;
+ if(e->num==0)
+  return 0;
+ if(!show_engine_grow((void**)&e->rows,&e->rowsize,(size_t)e->num*area,sizeof(int)*2))
+  {e->num=0;return -1;}
+ e->start[0]=0;
+ for(t=0;t<e->num;t++)
+  {
+   int   *row=e->rows+2*e->start[t];
+   size_t cnt=hquad_getreadonlyrow(hq,e->terms[t],row,area),i,j;
+   for(i=j=0;i<cnt;i++)
+    if(row[i*2+1]>1)
+     {row[j*2]=row[i*2];row[j*2+1]=row[i*2+1];j++;}
+   qsort(row,j,sizeof(int)*2,id_compare);
+   e->start[t+1]=e->start[t]+j;
+   if(j<e->start[shortest+1]-e->start[shortest])
+    shortest=t;
+  }
+ // the intersection is never longer than the shortest row
+ n=e->start[shortest+1]-e->start[shortest];
+ if(!show_engine_grow((void**)&e->res,&e->ressize,n+1,sizeof(int)*2))
+  {e->num=0;return -1;}
+ memcpy(e->res,e->rows+2*e->start[shortest],n*sizeof(int)*2);
+ for(t=0;(t<e->num)&&n;t++)
+  if(t!=shortest)
+   {
+    const int*row=e->rows+2*e->start[t];
+    size_t    cnt=e->start[t+1]-e->start[t],r=0,c=0,o=0;
+    while((r<n)&&(c<cnt))
+     if(e->res[r*2]<row[c*2])
+      r++;
+     else
+     if(row[c*2]<e->res[r*2])
+      c++;
+     else
+      {
+       e->res[o*2]=e->res[r*2];
+       e->res[o*2+1]=e->res[r*2+1]+row[c*2+1];
+       o++;r++;c++;
+      }
+    n=o;
+   }
+ qsort(e->res,n,sizeof(int)*2,show_compare);
+ if((topk>0)&&(n>(size_t)topk))
+  n=topk;
+ e->num=0;
+ return (int)n;
+}
+
+// --------------------------------------------------------------------
+//
+// library API (word2neighborhood.h)
+// a model owns dictionary, neighborhood, row weights and metric; after
+// opening, queries only read it and keep their buffers on their own,
+// so concurrent queries are safe. The CLI query below runs on the same
+// model, loading it step by step to report what it is doing
+//
+// --------------------------------------------------------------------
+
+struct w2n_model {
+ tfidf_dict   *dict;
+ hquad         hq;
+ row_weights   rw;
+ row_metric    rm;
+ similar_table st;
+ int           area,hasrows;
+};
+
+w2n_model*model_new(int area)
+{
+ w2n_model*m=(w2n_model*)calloc(1,sizeof(w2n_model));
+ if(m)
+  {
+   m->area=max(1,area);
+   m->dict=tfidf_dict_new(256*1024,64*1024,1);
+   if(m->dict==NULL)
+    {free(m);m=NULL;}
+  }
+ return m;
+}
+
+int model_readneighbors(w2n_model*m,const char*neighbors)
+{
+ if(!hquad_readbinary(&m->hq,neighbors))
+  return 0;
+ m->hasrows=1;
+ return row_weights_new(&m->rw,m->dict);
+}
+
+int model_setmetric(w2n_model*m,int metric)
+{
+ row_metric_delete(&m->rm);
+ // no neighborhood: the metric only has to match a similar file
+ if(!m->hasrows)
+  {
+   if((metric<0)||(metric>metric_ppmicosine))
+    return 0;
+   m->rm.metric=metric;
+   m->rm.way=(metric==metric_distance)?-1:1;
+   return 1;
+  }
+ return row_metric_new(&m->rm,metric,&m->hq,(int)m->dict->num,m->area);
+}
+
+w2n_model*w2n_open(const char*dictionary,const char*neighbors,int area,int metric,int flags,int*err)
+{
+ w2n_model*m=model_new(area);
+ int       e=W2N_OK;
+ if(m==NULL)
+  e=W2N_ERR_MEMORY;
+ else
+ if(!tfidf_dict_import(m->dict,dictionary))
+  e=W2N_ERR_DICTIONARY;
+ else
+ if((flags&W2N_PACKDICT)&&(tfidf_dict_pack(m->dict)==0))
+  e=W2N_ERR_MEMORY;
+ else
+ if(neighbors&&*neighbors&&!model_readneighbors(m,neighbors))
+  e=W2N_ERR_NEIGHBORS;
+ else
+ if(!model_setmetric(m,metric))
+  e=W2N_ERR_METRIC;
+ if(e!=W2N_OK)
+  {
+   w2n_close(m);
+   m=NULL;
+  }
+ if(err) *err=e;
+ return m;
+}
+
+int w2n_opensimilar(w2n_model*m,const char*similar)
+{
+ similar_table_close(&m->st);
+ if(!similar_table_open(&m->st,similar))
+  return W2N_ERR_SIMILAR;
+ // the table holds the best words of one dictionary, metric and area
+ if((m->st.num!=(int)m->dict->num)||(m->st.metric!=m->rm.metric)||(m->st.area!=m->area))
+  {
+   similar_table_close(&m->st);
+   return W2N_ERR_MISMATCH;
+  }
+ return W2N_OK;
+}
+
+void w2n_close(w2n_model*m)
+{
+ if(m)
+  {
+   similar_table_close(&m->st);
+   row_metric_delete(&m->rm);
+   if(m->hasrows)
+    {
+     row_weights_delete(&m->rw);
+     hquad_delete(&m->hq);
+    }
+   tfidf_dict_delete(m->dict);
+   free(m);
+  }
+}
+
+int w2n_size(const w2n_model*m)
+{
+ return (int)m->dict->num;
+}
+
+int w2n_lookup(const w2n_model*m,const char*word)
+{
+ tfidf_dict *d=m->dict;
+ char       *buf=d->packed?(char*)malloc(d->packed->maxlen+1):NULL;
+ tfidf_lemma*fnd=NULL;
+ if(buf||!d->packed)
+  fnd=tfidf_dict_findbuf(d,word,string_hashfunct(word),buf);
+ free(buf);
+ return fnd?(int)(fnd-d->items):-1;
+}
+
+int w2n_word(const w2n_model*m,int id,char*out,int outsize)
+{
+ tfidf_dict*d=m->dict;
+ if((id<0)||(id>=(int)d->num))
+  return 0;
+ if(d->packed)
+  {
+   char*buf=(char*)malloc(d->packed->maxlen+1);
+   int  ok=0;
+   if(buf)
+    {
+     front_coded_get(d->packed,id,buf);
+     if((int)strlen(buf)<outsize)
+      {strcpy(out,buf);ok=1;}
+     free(buf);
+    }
+   return ok;
+  }
+ if((int)strlen(d->items[id].str)>=outsize)
+  return 0;
+ strcpy(out,d->items[id].str);
+ return 1;
+}
+
+int w2n_row(const w2n_model*m,int id,int*row,int maxitems)
+{
+ if((id<0)||(id>=(int)m->dict->num)||(maxitems<=0)||!m->hasrows)
+  return 0;
+ return (int)hquad_getreadonlyrow((hquad*)&m->hq,id,row,maxitems);
+}
+
+// split row of id, sorted by id, prepared for the model metric
+static int model_splitrow(const w2n_model*m,split_row*r,int*row,int id,int word)
+{
+ size_t cnt=hquad_getreadonlyrow((hquad*)&m->hq,id,row,m->area);
+ qsort(row,cnt,sizeof(int)*2,id_compare);
+ split_row_set(r,row,cnt,word?&m->rw:NULL);
+ row_metric_prepare(&m->rm,r,id,word);
+ return (int)cnt;
+}
+
+int w2n_similar(const w2n_model*m,int id,w2n_result*out,int k)
+{
+ int n=0;
+ if((k<=0)||(id<0)||(id>=(int)m->dict->num))
+  return 0;
+ if(m->st.num&&(k<=m->st.k))
+  memcpy(out,similar_table_get((similar_table*)&m->st,id),k*sizeof(best));
+ else
+ if(!m->hasrows)
+  best_reset(out,k);
+ else
+  {
+   split_row ws,cs;
+   int      *row=(int*)malloc(((size_t)m->area+1)*2*sizeof(int));
+   int       ok=split_row_new(&ws,m->area)&split_row_new(&cs,m->area),y;
+   best_reset(out,k);
+   if(row&&ok)
+    {
+     model_splitrow(m,&ws,row,id,1);
+     for(y=0;y<(int)m->dict->num;y++)
+      if(y!=id)
+       if(model_splitrow(m,&cs,row,y,0))
+        best_add(out,k,y,m->rm.kernel(&m->rw,&m->rm,&ws,&cs),m->rm.way);
+    }
+   split_row_delete(&ws);
+   split_row_delete(&cs);
+   free(row);
+   if(!(row&&ok))
+    return -1;
+  }
+ while((n<k)&&(out[n].id!=-1))
+  n++;
+ return n;
+}
+
+int w2n_score(const w2n_model*m,int a,int b,float*score)
+{
+ split_row ws,cs;
+ int      *row=(int*)malloc(((size_t)m->area+1)*2*sizeof(int));
+ int       ok=split_row_new(&ws,m->area)&split_row_new(&cs,m->area),ret=0;
+ if((a>=0)&&(a<(int)m->dict->num)&&(b>=0)&&(b<(int)m->dict->num)&&row&&ok&&m->hasrows)
+  {
+   model_splitrow(m,&ws,row,a,1);
+   if(model_splitrow(m,&cs,row,b,0))
+    {
+     *score=m->rm.kernel(&m->rw,&m->rm,&ws,&cs);
+     ret=1;
+    }
+  }
+ split_row_delete(&ws);
+ split_row_delete(&cs);
+ free(row);
+ return ret;
+}
+
+// ids out of the dictionary are skipped
+int w2n_show(const w2n_model*m,const int*ids,int n,w2n_result*out,int k)
+{
+ show_engine se;
+ int         i,j=0;
+ if(!m->hasrows)
+  return 0;
+ memset(&se,0,sizeof(se));
+ for(i=0;i<n;i++)
+  if((ids[i]>=0)&&(ids[i]<(int)m->dict->num))
+   if(!show_engine_addterm(&se,ids[i]))
+    j=-1;
+ if(j==0)
+  j=show_engine_run(&se,(hquad*)&m->hq,m->area,k);
+ for(i=0;i<j;i++)
+  {
+   out[i].id=se.res[i*2];
+   out[i].score=(float)se.res[i*2+1];
+  }
+ show_engine_delete(&se);
+ return j;
 }
 
 // --------------------------------------------------------------------
 
-int queryneighbors(const char*dictionary,const char*neighbors,int area)
+int queryneighbors(const char*dictionary,const char*neighbors,const char*vectors,const char*quantized,const char*similar,int area,int metric,int rerank,int showtop,int flags)
 { 
- int        ret=0;
- tfidf_dict*dict=tfidf_dict_new(256*1024,64*1024,1);
- if(dict)
+ int       ret=0;
+ w2n_model*m=model_new(area);
+ if(m)
   {
+   tfidf_dict*dict=m->dict;
    printf("reading dictionary (%s)...\n",dictionary);
    if(tfidf_dict_import(dict,dictionary))
     {
-     hquad hq;
-     printf("reading neighborhood binary file (%s)...\n",neighbors);
-     if(hquad_readbinary(&hq,neighbors))
+     if(flags&4)
+      {
+       // strings and hash index, before and after: items keep their
+       // (now NULL) str pointers either way
+       size_t used,reserved,index=dict->hsize*sizeof(dict->hitems[0]);
+       memorybag_bytes(&dict->heap,&used,&reserved);
+       switch(tfidf_dict_pack(dict))
+        {
+         case 1:
+          printf("dictionary strings front coded: %llu bytes with the hash index (were %llu)%s, plus %llu bytes of item string pointers\n",(unsigned long long)(tfidf_dict_packedbytes(dict->packed)+dict->hsize*sizeof(dict->hitems[0])),(unsigned long long)(used+index),dict->packed->sorted?", sorted":"",(unsigned long long)(dict->num*sizeof(dict->items[0].str)));
+          break;
+         case -1:
+          printf("front coding doesn't save memory on this dictionary (sort it by string, -sort 0): strings kept plain\n");
+          break;
+         default:
+          printf("can't pack dictionary strings\n");
+        }
+      }
+     // quantized vectors alone answer word queries: no neighborhood
+     if(*neighbors)
+      printf("reading neighborhood binary file (%s)...\n",neighbors);
+     if((*neighbors==0)||model_readneighbors(m,neighbors))
       {
-       int*wordrow=(int*)calloc(area,sizeof(int)*2);
-       int*checkrow=(int*)calloc(area,sizeof(int)*2);
-       printf("Insert word(s) to get most similar elements (empty to quit):\n");
-       while(1)
+       dense_vectors     dv;
+       quantized_vectors qv;
+       show_engine       se;
+       memset(&se,0,sizeof(se));
+       memset(&dv,0,sizeof(dv));
+       if(vectors&&*vectors)
+        {
+         printf("reading vectors file (%s)...\n",vectors);
+         if(!dense_vectors_readbinary(&dv,vectors))
+          printf("can't read vectors file - using neighborhood rows\n");
+         else
+         if(dv.num!=(int)dict->num)
+          {
+           printf("vectors file doesn't match dictionary - using neighborhood rows\n");
+           dense_vectors_delete(&dv);
+          }
+        }
+       memset(&qv,0,sizeof(qv));
+       if(quantized&&*quantized)
+        {
+         printf("mapping quantized vectors file (%s)...\n",quantized);
+         if(!quantized_vectors_open(&qv,quantized))
+          printf("can't read quantized vectors file\n");
+         else
+         if(qv.num!=(int)dict->num)
+          {
+           printf("quantized vectors file doesn't match dictionary - ignored\n");
+           quantized_vectors_close(&qv);
+          }
+        }
+       if(!model_setmetric(m,metric))
+        {
+         printf("can't set up %s metric - using distance\n",metric_names[metric]);
+         model_setmetric(m,metric_distance);
+        }
+       if(similar&&*similar)
+        {
+         printf("mapping similar file (%s)...\n",similar);
+         switch(w2n_opensimilar(m,similar))
+          {
+           case W2N_ERR_SIMILAR:
+            printf("can't read similar file\n");
+           break;
+           case W2N_ERR_MISMATCH:
+            printf("similar file doesn't match dictionary, -metric or -area - ignored, scanning rows\n");
+           break;
+          }
+        }
+       if(!m->hasrows&&!qv.num)
+        printf("nothing to query without a neighborhood (-neighbors) or quantized vectors\n");
+       else
+        printf("Insert word(s) to get most similar elements (empty to quit):\n");
+       while(m->hasrows||qv.num)
         {
          size_t        w=0;
          tfidf_lemma  *word[8];
          char          line[1024];
-         gets(line);
+         if(fgets(line,sizeof(line),stdin)==NULL)
+          *line=0;
          removeendingcrlf(line);
          if(*line==0)
           break;
          else
+         if((memcmp(line,"show ",5)==0)&&!m->hasrows)
+          printf("show needs a neighborhood (-neighbors)\n");
+         else
          if(memcmp(line,"show ",5)==0)
           {
-           const char   *l=line+5;
-           int          *sum=(int*)calloc(dict->num,sizeof(int));
-           unsigned char*mask=(unsigned char*)calloc(dict->num,sizeof(unsigned char));
-           size_t        i,j,pow,wpow=0;
-           while(l&&(w<8))
+           const char*l=line+5;
+           int        i,j;
+           char       sbuf[tfidf_dict_maxstr];
+           while(l)
             {
-             char wrd[256];
+             char         wrd[256];
+             tfidf_lemma *found;
              l=gettoken(l,wrd,sizeof(wrd),' ');
-             word[w]=tfidf_dict_find(dict,wrd);
-             if(word[w]==NULL)
+             found=tfidf_dict_find(dict,wrd);
+             if(found==NULL)
               printf("word \"%s\" not in dictionary, sorry.\n",wrd);
              else
-              w++; 
-            }
-           for(pow=1,i=0;i<w;i++,pow*=2)
-            {
-             size_t y,id=word[i]-dict->items;
-             size_t wordrowcnt=hquad_getreadonlyrow(&hq,id,wordrow,area);
-             for(y=0;y<wordrowcnt;y++)
-              if(wordrow[y*2+1]>1)
-               {
-                sum[wordrow[y*2]]+=wordrow[y*2+1];
-                mask[wordrow[y*2]]|=pow;
-               }
-             wpow|=pow;  
+             if(!show_engine_addterm(&se,(int)(found-dict->items)))
+              break;
             }
-           for(j=i=0;i<dict->num;i++)
-            if(sum[i]&&(mask[i]==wpow))
-             {wordrow[j*2]=i;wordrow[j*2+1]=sum[i];j++;}
-           qsort(wordrow,j,sizeof(int)*2,cnt_compare);  
+           j=show_engine_run(&se,&m->hq,m->area,showtop);
            for(i=0;i<j;i++) 
             {
              if(i) printf(", ");
-             printf("%s",dict->items[wordrow[i*2]].str);
+             printf("%s",tfidf_dict_string(dict,se.res[i*2],sbuf));
             }
            printf("\n");             
-           free(sum); 
           }
          else
           {
@@ -1709,72 +6951,98 @@ int queryneighbors(const char*dictionary,const char*neighbors,int area)
              else
               w++; 
             }          
-           if(w)
+           if((w==1)&&m->st.num)
+            {
+             best b[16];
+             w2n_similar(m,(int)(word[0]-dict->items),&b[0],min(m->st.k,16));
+             best_print(dict,&b[0],min(m->st.k,16));
+            }
+           else
+           if(w&&qv.num)
             {
-             size_t y,id=word[0]-dict->items,same;
+             size_t y,id=word[0]-dict->items;
              best   b[16];
-             int    bestid=-1;
-             float  distance,bestdistance=-1;
-             size_t wordrowcnt=hquad_getreadonlyrow(&hq,id,wordrow,area);
-             qsort(wordrow,wordrowcnt,sizeof(int)*2,id_compare);
-             best_reset(&b[0],sizeof(b)/sizeof(b[0]));
+             int    hm=sizeof(b)/sizeof(b[0]);
+             best_reset(&b[0],hm);
              if(w==2)
               {
-               size_t checkrowcnt;
                y=word[1]-dict->items;
-               checkrowcnt=hquad_getreadonlyrow(&hq,y,checkrow,area);          
-               if(checkrowcnt)
-                {     
-                 qsort(checkrow,checkrowcnt,sizeof(int)*2,id_compare);
-                 distance=row_distance(dict,wordrow,wordrowcnt,checkrow,checkrowcnt,&same);
-                 if((bestdistance==-1)||(distance<bestdistance))
-                  bestdistance=distance;
-                 best_add(&b[0],sizeof(b)/sizeof(b[0]),y,distance,-1);
-                }                
+               if(dv.num)
+                best_add(&b[0],hm,y,vector_dot(dv.items+id*dv.dim,dv.items+y*dv.dim,dv.dim),1);
+               else
+                best_add(&b[0],hm,y,quantized_vectors_score(&qv,id,y),1);
               }
-             else 
-             for(y=0;y<dict->num;y++)     
-              if(y!=id)
-               {
-                size_t checkrowcnt=hquad_getreadonlyrow(&hq,y,checkrow,area);          
-                if(checkrowcnt)
-                 {     
-                  qsort(checkrow,checkrowcnt,sizeof(int)*2,id_compare);
-                  if(1)
-                   {                    
-                    distance=row_distance(dict,wordrow,wordrowcnt,checkrow,checkrowcnt,&same);
-                    if((bestdistance==-1)||(distance<bestdistance))
-                     bestdistance=distance;
-                    best_add(&b[0],sizeof(b)/sizeof(b[0]),y,distance,-1);
+             else
+              {
+               int   cm=dv.num?max(hm,rerank):hm,c;
+               best *cand=(best*)calloc(cm,sizeof(best));
+               if(cand)
+                {
+                 best_reset(cand,cm);
+                 for(y=0;y<dict->num;y++)
+                  if(y!=id)
+                   {
+                    float score=quantized_vectors_score(&qv,id,y);
+                    if((cand[cm-1].id==-1)||(score>cand[cm-1].score))
+                     best_add(cand,cm,y,score,1);
                    }
+                 for(c=0;(c<cm)&&(cand[c].id!=-1);c++)
+                  if(dv.num)
+                   best_add(&b[0],hm,cand[c].id,vector_dot(dv.items+id*dv.dim,dv.items+(size_t)cand[c].id*dv.dim,dv.dim),1);
                   else
-                   { 
-                    distance=row_distanceshare(dict->num,wordrow,wordrowcnt,checkrow,checkrowcnt);
-                    best_add(&b[0],sizeof(b)/sizeof(b[0]),y,distance,1);
-                   } 
-                 }  
-               }            
-             printf("Similar to: ");
-             for(y=0;y<sizeof(b)/sizeof(b[0]);y++)
-              if(b[y].id!=-1)
-               { 
-                if(y) printf(", ");               
-                printf("%s (%.2f)",dict->items[b[y].id].str,b[y].score);  
-               } 
-              else
-               break; 
-             printf("\n");  
+                   best_add(&b[0],hm,cand[c].id,cand[c].score,1);
+                 free(cand);
+                }
+              }
+             best_print(dict,&b[0],hm);
+            }
+           else
+           if(w&&dv.num)
+            {
+             size_t      y,id=word[0]-dict->items;
+             best        b[16];
+             const float*v=dv.items+id*dv.dim;
+             best_reset(&b[0],sizeof(b)/sizeof(b[0]));
+             if(w==2)
+              {
+               y=word[1]-dict->items;
+               best_add(&b[0],sizeof(b)/sizeof(b[0]),y,vector_dot(v,dv.items+y*dv.dim,dv.dim),1);
+              }
+             else
+              for(y=0;y<dict->num;y++)
+               if(y!=id)
+                best_add(&b[0],sizeof(b)/sizeof(b[0]),y,vector_dot(v,dv.items+y*dv.dim,dv.dim),1);
+             best_print(dict,&b[0],sizeof(b)/sizeof(b[0]));
+            }
+           else
+           if(w)
+            {
+             int   id=(int)(word[0]-dict->items);
+             best  b[16];
+             int   hm=sizeof(b)/sizeof(b[0]);
+             float score;
+             if(w==2)
+              {
+               best_reset(&b[0],hm);
+               if(w2n_score(m,id,(int)(word[1]-dict->items),&score))
+                best_add(&b[0],hm,(int)(word[1]-dict->items),score,m->rm.way);
+              }
+             else
+              w2n_similar(m,id,&b[0],hm);
+             best_print(dict,&b[0],hm);
             } 
           } 
         }
-       free(checkrow);
-       free(wordrow); 
+       show_engine_delete(&se);
+       quantized_vectors_close(&qv);
+       dense_vectors_delete(&dv);
       }
      else
       {printf("can't read neighborhood (binary) file\n");ret=0;}
     }   
    else 
     {printf("can't read dictionary file\n");ret=0;}
+   w2n_close(m);
   }  
  else   
   {printf("can't create dictionary\n");ret=0;}
@@ -1782,6 +7050,385 @@ int queryneighbors(const char*dictionary,const char*neighbors,int area)
 }
 
 // --------------------------------------------------------------------
+//
+// benchmark (benchmark builds only, -DW2N_BENCHMARK)
+// times the core structures and kernels in isolation on synthetic
+// zipfian data, and stores results as json so that different versions
+// can be compared
+//
+// --------------------------------------------------------------------
+
+#if defined(W2N_BENCHMARK)
+
+typedef struct {
+ double       *cdf;
+ int           vocab;
+ unsigned int  seed;
+}zipf_gen;
+
+unsigned int bench_rand(unsigned int*seed)
+{
+ *seed^=*seed<<13;
+ *seed^=*seed>>17;
+ *seed^=*seed<<5;
+ return *seed;
+}
+
+int zipf_new(zipf_gen*z,int vocab,unsigned int seed)
+{
+ int    i;
+ double sum=0;
+ z->vocab=vocab;
+ z->seed=seed?seed:1;
+ z->cdf=(double*)malloc(vocab*sizeof(double));
+ if(z->cdf==NULL)
+  return 0;
+ for(i=0;i<vocab;i++)
+  z->cdf[i]=(sum+=1.0/(i+1));
+ for(i=0;i<vocab;i++)
+  z->cdf[i]/=sum;
+ return 1;
+}
+
+int zipf_next(zipf_gen*z)
+{
+ double u=(bench_rand(&z->seed)&0xFFFFFF)/(double)0x1000000;
+ int    lo=0,hi=z->vocab-1;
+ while(lo<hi)
+  {
+   int mid=(lo+hi)/2;
+   if(z->cdf[mid]<u)
+    lo=mid+1;
+   else
+    hi=mid;
+  }
+ return lo;
+}
+
+void zipf_delete(zipf_gen*z)
+{
+ free(z->cdf);
+}
+
+// synthetic word for a zipf rank: short for frequent ranks, with some
+// accented (utf8) letters and a few digits/punctuation only tokens
+void zipf_word(int rank,char*word)
+{
+ static const char*letters[]={"a","e","i","o","u","r","s","t","n","l","c","d","m","p","\xC3\xA0","\xC3\xA9"};
+ if((rank%97)==3)
+  sprintf(word,"%d",rank);
+ else
+ if((rank%89)==5)
+  strcpy(word,"--");
+ else
+  {
+   *word=0;
+   do
+    {
+     strcat(word,letters[rank&15]);
+     rank>>=4;
+    }
+   while(rank);
+   strcat(word,"x");
+  }
+}
+
+int bench_makecorpus(const char*fn,int fileformat,int docs,int words,int vocab,unsigned int seed)
+{
+ FILE*f=fopen(fn,"wb+");
+ if(f)
+  {
+   static const char*upos[]={"NOUN","VERB","ADJ","DET","ADP","PUNCT","ADV","CCONJ","AUX","PROPN"};
+   zipf_gen z;
+   int      d,w;
+   if(!zipf_new(&z,vocab,seed))
+    {fclose(f);return 0;}
+   for(d=0;d<docs;d++)
+    {
+     if(fileformat==fileformat_conllu)
+      fprintf(f,"# newdoc id = d%d\n# newpar\n",d);
+     for(w=0;w<words;w++)
+      {
+       char word[64];
+       int  rank=zipf_next(&z);
+       zipf_word(rank,word);
+       if(fileformat==fileformat_conllu)
+        fprintf(f,"%d\t%s\t%s\t%s\t_\t_\t0\t_\t_\t%s\n",w+1,word,word,upos[rank%10],(rank%7)?"#-1":"S1");
+       else
+        fprintf(f,"%s%s",word,((w%17)==16)?".\n":" ");
+      }
+     fprintf(f,"\n");
+    }
+   zipf_delete(&z);
+   fclose(f);
+   return 1;
+  }
+ else
+  return 0;
+}
+
+typedef struct {
+ const char*name;
+ double     ops,seconds,bytes;
+ size_t     allocs,allocbytes;
+ double     extra;
+ const char*extraname;
+}bench_result;
+
+typedef struct {
+ bench_result items[32];
+ int          num;
+ double       t0;
+ size_t       a0,b0;
+}bench_results;
+
+void bench_begin(bench_results*br)
+{
+ br->a0=bench_allocs;
+ br->b0=bench_allocbytes;
+ br->t0=timer_now();
+}
+
+bench_result*bench_end(bench_results*br,const char*name,double ops,double bytes)
+{
+ double        t=timer_now();
+ bench_result*r=&br->items[br->num++];
+ memset(r,0,sizeof(*r));
+ r->name=name;
+ r->ops=ops;
+ r->bytes=bytes;
+ r->seconds=t-br->t0;
+ r->allocs=bench_allocs-br->a0;
+ r->allocbytes=bench_allocbytes-br->b0;
+ printf(" %-24s %12.1f ns/op %14.0f op/s",name,r->ops?r->seconds*1e9/r->ops:0,r->seconds?r->ops/r->seconds:0);
+ if(bytes)
+  printf(" %8.1f MB/s",r->seconds?bytes/r->seconds/(1024*1024):0);
+ printf(" allocs: %llu\n",(unsigned long long)r->allocs);
+ return r;
+}
+
+int bench_writejson(bench_results*br,const char*fn,int scale)
+{
+ FILE*f=fopen(fn,"wb+");
+ if(f)
+  {
+   int i;
+   fprintf(f,"{\n \"tool\": \"word2neighborhood\",\n \"scale\": %d,\n \"simd\": \"%s\",\n \"benchmarks\": [\n",scale,
+#if defined(W2N_AVX2)
+           "avx2"
+#elif defined(W2N_SSE2)
+           "sse2"
+#else
+           "scalar"
+#endif
+          );
+   for(i=0;i<br->num;i++)
+    {
+     bench_result*r=&br->items[i];
+     fprintf(f,"  {\"name\": \"%s\", \"ops\": %.0f, \"seconds\": %.6f, \"ns_per_op\": %.3f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, \"allocs\": %llu, \"alloc_bytes\": %llu",
+             r->name,r->ops,r->seconds,r->ops?r->seconds*1e9/r->ops:0,r->seconds?r->ops/r->seconds:0,(r->seconds&&r->bytes)?r->bytes/r->seconds/(1024*1024):0,(unsigned long long)r->allocs,(unsigned long long)r->allocbytes);
+     if(r->extraname)
+      fprintf(f,", \"%s\": %.3f",r->extraname,r->extra);
+     fprintf(f,"}%s\n",(i+1<br->num)?",":"");
+    }
+   fprintf(f," ]\n}\n");
+   fclose(f);
+   return 1;
+  }
+ else
+  return 0;
+}
+
+double bench_filesize(const char*fn)
+{
+ FILE  *f=fopen(fn,"rb");
+ double size=0;
+ if(f)
+  {
+   fseek(f,0,SEEK_END);
+   size=(double)ftell(f);
+   fclose(f);
+  }
+ return size;
+}
+
+int benchmark(const char*out,int scale)
+{
+ bench_results br;
+ zipf_gen      z;
+ int           vocab=50000*scale,tokens=1000000*scale,i;
+ int          *ids=(int*)malloc(tokens*sizeof(int));
+ char        **strs=(char**)malloc(vocab*sizeof(char*));
+ tfidf_dict   *dict=tfidf_dict_new(256*1024,64*1024,1);
+ memset(&br,0,sizeof(br));
+ memset(&z,0,sizeof(z));
+ if((ids==NULL)||(strs==NULL)||(dict==NULL)||!zipf_new(&z,vocab,12345))
+  {
+   printf("benchmark: out of memory\n");
+   free(ids);free(strs);zipf_delete(&z);
+   if(dict) tfidf_dict_delete(dict);
+   return 0;
+  }
+ for(i=0;i<vocab;i++)
+  {
+   char word[64];
+   zipf_word(i,word);
+   sprintf(word+strlen(word),"%d",i);
+   strs[i]=strdup(word);
+  }
+ for(i=0;i<tokens;i++)
+  ids[i]=zipf_next(&z);
+ printf("benchmark (vocabulary %d, tokens %d)\n",vocab,tokens);
+
+ // dictionary
+ bench_begin(&br);
+ for(i=0;i<tokens;i++)
+  tfidf_dict_add(dict,strs[ids[i]],i/1000,1);
+ bench_end(&br,"tfidf_dict_add",tokens,0);
+ bench_begin(&br);
+ for(i=0;i<tokens;i++)
+  tfidf_dict_find(dict,strs[ids[i]]);
+ bench_end(&br,"tfidf_dict_find_hit",tokens,0);
+ bench_begin(&br);
+ for(i=0;i<tokens;i++)
+  tfidf_dict_find(dict,"zz-not-there");
+ bench_end(&br,"tfidf_dict_find_miss",tokens,0);
+
+ // hashquads
+ {
+  hashquads     hs;
+  bench_result *r;
+  double        probes=0;
+  size_t        j;
+  hashquads_new(&hs,683);
+  bench_begin(&br);
+  for(i=0;i<tokens;i++)
+   hashquads_add(&hs,(ids[i]&0xFFF)|((ids[(i+1)%tokens]&0xFFF)<<16),1,NULL);
+  r=bench_end(&br,"hashquads_add",tokens,0);
+  for(j=0;j<(size_t)hs.size;j++)
+   if(hs.items[j].cnt)
+    probes+=(j+hs.size-hashquadfunct(hs.items[j].coord)%hs.size)%hs.size;
+  r->extraname="avg_probe_length";
+  r->extra=hs.num?probes/hs.num:0;
+  printf("  (%d cells in %d slots, average probe length %.2f)\n",hs.num,hs.size,r->extra);
+  hashquads_delete(&hs);
+ }
+
+ // tokenizers
+ {
+  int fmt;
+  for(fmt=fileformat_raw;fmt<=fileformat_conllu;fmt++)
+   {
+    const char*fn=(fmt==fileformat_raw)?"bench.raw.txt":"bench.conllu";
+    FILE      *f;
+    if(bench_makecorpus(fn,fmt,200*scale,5000,vocab,777)&&(f=fopen(fn,"rb")))
+     {
+      double cnt=0;
+      int    isutf8=file_checkutf(f);
+      setvbuf(f,NULL,_IOFBF,16*1024*1024);
+      bench_begin(&br);
+      while(!feof(f))
+       {
+        char       word[builtin_max_word_len*2],feat[builtin_max_word_len];
+        token_info ti;
+        if(fmt==fileformat_raw)
+         read_raw_word(f,word,sizeof(word),feat,sizeof(feat),isutf8,&ti);
+        else
+         read_conllu_word(f,word,sizeof(word),feat,sizeof(feat),isutf8,2,1|2|4|8|16|32);
+        cnt++;
+       }
+      bench_end(&br,(fmt==fileformat_raw)?"read_raw_word":"read_conllu_word",cnt,bench_filesize(fn));
+      fclose(f);
+     }
+    remove(fn);
+   }
+ }
+
+ // addcorpus
+ {
+  hquad hq;
+  int   err,chunk=4096,pairs=0;
+  hquad_new(&hq,8192,vocab,vocab);
+  bench_begin(&br);
+  for(i=0;i+chunk<=tokens;i+=chunk)
+   pairs+=addcorpus(&hq,ids+i,chunk,16,0,&err);
+  bench_end(&br,"addcorpus_pair",pairs,0);
+
+  // row distances (rows extracted and sorted beforehand)
+  hquad_setreadonlymode(&hq);
+  {
+   int         rows=min(vocab,20000),y,calls=0,area=64;
+   int        *data=(int*)malloc((size_t)rows*area*2*sizeof(int));
+   size_t     *cnts=(size_t*)malloc(rows*sizeof(size_t)),same;
+   tfidf_dict *wd=tfidf_dict_new(vocab,1024,1);
+   row_weights rw;
+   split_row   ws,cs;
+   float       sink=0;
+   int         ok=(data!=NULL)&&(cnts!=NULL)&&(wd!=NULL);
+   memset(&rw,0,sizeof(rw));
+   ok&=split_row_new(&ws,area)&split_row_new(&cs,area);
+   for(i=0;ok&&(i<vocab);i++)
+    {
+     tfidf_lemma*lm=tfidf_dict_add(wd,strs[i],1,1+i%1000);
+     if(lm)
+      lm->tfidf=0.001f+(i%100)/1000.0f;
+     else
+      ok=0;
+    }
+   ok=ok&&row_weights_new(&rw,wd);
+   if(ok)
+    {
+     for(y=0;y<rows;y++)
+      {
+       cnts[y]=hquad_getreadonlyrow(&hq,y,data+(size_t)y*area*2,area);
+       qsort(data+(size_t)y*area*2,cnts[y],sizeof(int)*2,id_compare);
+      }
+     split_row_set(&ws,data,cnts[0],&rw);
+     bench_begin(&br);
+     for(y=1;y<rows;y++)
+      {
+       sink+=row_distance(wd,data,cnts[0],data+(size_t)y*area*2,cnts[y],&same);
+       calls++;
+      }
+     bench_end(&br,"row_distance",calls,0);
+     bench_begin(&br);
+     for(y=1;y<rows;y++)
+      {
+       split_row_set(&cs,data+(size_t)y*area*2,cnts[y],NULL);
+       sink+=row_distancefast(&rw,&ws,&cs,&same);
+      }
+     bench_end(&br,"row_distancefast",calls,0);
+     if(sink==12345) printf(" ");
+    }
+   else
+    printf("  (row distances skipped: out of memory)\n");
+   split_row_delete(&ws);
+   split_row_delete(&cs);
+   row_weights_delete(&rw);
+   if(wd) tfidf_dict_delete(wd);
+   free(data);free(cnts);
+  }
+  hquad_delete(&hq);
+ }
+
+ tfidf_dict_delete(dict);
+ for(i=0;i<vocab;i++)
+  free(strs[i]);
+ free(strs);
+ free(ids);
+ zipf_delete(&z);
+ if(bench_writejson(&br,out,scale))
+  printf("results written to %s\n",out);
+ else
+  printf("can't write %s\n",out);
+ return 1;
+}
+
+#endif
+
+// --------------------------------------------------------------------
+
+#if !defined(W2N_LIBRARY)
 
 int main(int argc,char* argv[])
 {
@@ -1792,7 +7439,7 @@ int main(int argc,char* argv[])
    printf(" (raw or in CoNLLU format), ansi or utf8, using TFxIDF\n");
    printf("\n");
    printf("Options:\n");
-   printf(" -corpus/-crp <filename> [needed, corpus to analyze]\n");
+   printf(" -corpus/-crp <filename> [needed, corpus to analyze - .gz/.zst with -DW2N_ZLIB/-DW2N_ZSTD builds]\n");
    printf("[build]\n");
    printf(" -create/-c dictionary|dict|d / neighborhood|neighbors|n [needed]\n");
    printf("  create a dictionary from corpus or create neighborhood from dictionary&corpus\n");      
@@ -1807,8 +7454,45 @@ int main(int argc,char* argv[])
    printf(" -width <width size> [radius used when creating neighborhood data, default 16]\n");
    printf(" -area <area size> [neighborhood max size for output, default: 64]\n");
    printf(" -bigrams [consider/generate bigrams]\n");
+   printf(" -compressed [write binary neighborhoods as compressed rows (HQUC)]\n");
+   printf(" -sample <t> [pair frequent words less often, word2vec style (1e-3..1e-5), dictionary counts needed]\n");
+   printf(" -samplerescale [divide subsampled counts by the words keep probabilities]\n");
+   printf(" -seed <n> [subsampling random seed, default 1]\n");
+   printf(" -stats <filename> [json run statistics, phase timers need a -DW2N_STATS build]\n");
+   printf(" -range <start>:<end> [read just documents starting in this corpus byte range]\n");
+   printf(" -shard <i>/<N> [read just the i-th of N corpus ranges, i from 1 to N]\n");
+   printf(" -checkpoint <docs> [save neighborhood build state every <docs> documents]\n");
+   printf(" -checkpointfile <filename> [<neighbors>.ckpt if not specified]\n");
+   printf(" -resume [continue a neighborhood build from its last checkpoint]\n");
+   printf(" -update [add -corpus documents to existing -dict (with counts) and binary -neighbors files]\n");
+   printf(" -merge <dict> <neighbors> ... [sum shard couples into -dict and binary -neighbors files]\n");
+   printf(" -mergedicts <dict> ... [sum shard dictionaries into -dict]\n");
+   printf(" -mergecut [apply dictionary count cuts when merging]\n");
+   printf("[embeddings]\n");
+   printf(" -create/-c embeddings|vectors|e [dense vectors from dictionary&neighborhood]\n");
+   printf(" -vectors/-v <filename> [vectors file, <corpus>.vectors if not specified]\n");
+   printf(" -dim <size> [vectors dimension, default 128]\n");
+   printf(" -threads <count> [worker threads, default: cpu count]\n");
+   printf(" -hugepages [transparent huge pages for dictionary and neighborhood memory]\n");
+   printf(" -create/-c quantized|q8 [int8 quantized copy of a vectors file]\n");
+   printf(" -quantized/-q8 <filename> [quantized vectors file, <vectors>.q8 if not specified]\n");
+   printf(" -rerank <count> [query candidates re-ranked with -vectors, default 64]\n");
+   printf(" -packdict [front coded, read only dictionary strings for queries]\n");
+   printf("[similar]\n");
+   printf(" -create/-c similar|sim [top K neighbours of every word from dictionary&neighborhood]\n");
+   printf(" -similar <filename> [similar file, <neighbors>.similar if not specified - queries use it only if given]\n");
+   printf(" -topk <count> [neighbours stored for each word, default 50 - with -query, max show results]\n");
+   printf(" -metric distance|share|cosine|jaccard|ppmi [row similarity for queries and similar files, default distance]\n");
    printf("[query]\n");
-   printf(" -query [consider/generate bigrams]\n\n");
+   printf(" -query [consider/generate bigrams]\n");
+   printf("[test]\n");
+   printf(" -selftest [check SIMD row kernels against the scalar ones]\n");
+#if defined(W2N_BENCHMARK)
+   printf(" -benchmark [time core structures on synthetic zipfian data]\n");
+   printf(" -benchsize <scale> [benchmark data size multiplier, default 1]\n");
+   printf(" -benchout <filename> [json results, default bench.json]\n");
+#endif
+   printf("\n");
    printf("Examples:\n");
    printf("[build dictionary from a corpus file]\n");
    printf(" word2neigh -c dictionary -crp \"war&peace.txt\" -dict novel.txt -stop en.stopwords.txt\n");
@@ -1824,9 +7508,12 @@ int main(int argc,char* argv[])
   }
  else
   {
-   char value[256],corpus[256],dict[256],stopwords[256],neighbors[256];
-   int  mode=0,fileformat=fileformat_raw,format=2,maxdocs=-1,width=16,area=64,flags=0,sortway=1,filter=filter_punct|filter_digits,conllufilter=1|2|4|8|16|32,emit=1|2|4;
-   *corpus=*dict=*stopwords=*neighbors=00;
+   char value[256],corpus[256],dict[256],stopwords[256],neighbors[256],vectors[256],quantized[256],similar[256],stats[256],checkpoint[256];
+   long long rangestart=0,rangeend=0;
+   float sample=0;
+   unsigned int seed=1;
+   int  checkpointevery=0,resume=0,dim=128,rerank=64,topk=50,metric=metric_distance,threads=thread_cpus(),mode=0,fileformat=fileformat_raw,format=2,maxdocs=-1,width=16,area=64,flags=0,sortway=1,filter=filter_punct|filter_digits,conllufilter=1|2|4|8|16|32,emit=1|2|4;
+   *corpus=*dict=*stopwords=*neighbors=*vectors=*quantized=*similar=*stats=*checkpoint=00;
    if(getparam("-create",argc,argv,value)||getparam("-c",argc,argv,value))
     {
      if((strcmp(value,"dict")==0)||(strcmp(value,"dictionary")==0)||(strcmp(value,"d")==0))
@@ -1834,16 +7521,39 @@ int main(int argc,char* argv[])
      else
      if((strcmp(value,"neighbors")==0)||(strcmp(value,"neighborhood")==0)||(strcmp(value,"n")==0))
       mode=2;      
+     else
+     if((strcmp(value,"embeddings")==0)||(strcmp(value,"vectors")==0)||(strcmp(value,"e")==0))
+      mode=5;
+     else
+     if((strcmp(value,"quantized")==0)||(strcmp(value,"q8")==0))
+      mode=6;
+     else
+     if((strcmp(value,"similar")==0)||(strcmp(value,"sim")==0))
+      mode=10;
     }
    else 
    if(getparam("-query",argc,argv,value)||getparam("-q",argc,argv,value))
     mode=3;
+   else
+   if(getparam("-update",argc,argv,NULL))
+    mode=8;
+   else
+   if(getparam("-merge",argc,argv,NULL)||getparam("-mergedicts",argc,argv,NULL))
+    mode=9;
+   else
+   if(getparam("-selftest",argc,argv,NULL))
+    mode=4;
+#if defined(W2N_BENCHMARK)
+   else
+   if(getparam("-benchmark",argc,argv,NULL))
+    mode=7;
+#endif
    else
     printf("missing -create param (dictionary or neighborhood request)\n");
    if(getparam("-corpus",argc,argv,value)||getparam("-crp",argc,argv,value)) 
     strcpy(corpus,value);
    else
-   if(mode!=3)
+   if((mode==1)||(mode==2)||(mode==8))
     printf("missing -corpus param (corpus file name)\n");
    if(getparam("-corpusformat",argc,argv,value)||getparam("-crpf",argc,argv,value)) 
     {
@@ -1878,6 +7588,52 @@ int main(int argc,char* argv[])
       {strcpy(neighbors,corpus);setextension(neighbors,"neighbors");}
      else   
      strcpy(neighbors,"neighbors.txt");    
+   if(getparam("-vectors",argc,argv,value)||getparam("-v",argc,argv,value)) 
+    strcpy(vectors,value);    
+   else
+   if((mode==5)||(mode==6))
+    {
+     if(*corpus)
+      {strcpy(vectors,corpus);setextension(vectors,"vectors");}
+     else   
+      strcpy(vectors,"vectors.bin");    
+    }
+   if(getparam("-quantized",argc,argv,value)||getparam("-q8",argc,argv,value)) 
+    {
+     strcpy(quantized,value);
+     // quantized queries read the neighborhood only when it is given
+     if((mode==3)&&!getparam("-neighbors",argc,argv,NULL)&&!getparam("-n",argc,argv,NULL))
+      *neighbors=0;
+    }
+   else
+   if(mode==6)
+    {
+     strcpy(quantized,vectors);setextension(quantized,"q8");
+    }
+   if(getparam("-similar",argc,argv,value))
+    strcpy(similar,value);
+   else
+   if(mode==10)
+    {
+     strcpy(similar,neighbors);setextension(similar,"similar");
+    }
+   if(getparam("-topk",argc,argv,value))
+    topk=max(1,atoi(value));
+   if(getparam("-metric",argc,argv,value))
+    {
+     metric=metric_fromname(value);
+     if(metric==-1)
+      {
+       printf("unknown -metric (%s) - using distance\n",value);
+       metric=metric_distance;
+      }
+    }
+   if(getparam("-rerank",argc,argv,value))
+    rerank=max(0,atoi(value));
+   if(getparam("-dim",argc,argv,value))
+    dim=max(1,atoi(value));
+   if(getparam("-threads",argc,argv,value))
+    threads=max(1,atoi(value));
    if(getparam("-stopwords",argc,argv,value)||getparam("-s",argc,argv,value)) 
     strcpy(stopwords,value);  
    if(getparam("-maxdocs",argc,argv,value))
@@ -1896,20 +7652,117 @@ int main(int argc,char* argv[])
     emit=atoi(value);        
    if(getparam("-bigrams",argc,argv,value))
     flags|=1;           
+   if(getparam("-compressed",argc,argv,NULL))
+    flags|=2;
+   if(getparam("-hugepages",argc,argv,NULL))
+    memorybag_hugepages=1;
+   if(getparam("-packdict",argc,argv,NULL))
+    flags|=4;
+   if(getparam("-sample",argc,argv,value))
+    sample=max(0.0f,(float)atof(value));
+   if(getparam("-samplerescale",argc,argv,NULL))
+    flags|=8;
+   if(getparam("-seed",argc,argv,value))
+    seed=(unsigned int)strtoul(value,NULL,10);
+   if(getparam("-stats",argc,argv,value))
+    strcpy(stats,value);
+   if(getparam("-range",argc,argv,value))
+    {
+     const char*colon=strchr(value,':');
+     rangestart=atoll(value);
+     if(colon&&colon[1])
+      rangeend=atoll(colon+1);
+    }
+   else
+   if(getparam("-shard",argc,argv,value))
+    {
+     // -shard i/N, i from 1 to N: byte range i of N same size ranges
+     int   shard=atoi(value),shards=strchr(value,'/')?atoi(strchr(value,'/')+1):0;
+     FILE *f=fopen(corpus,"rb");
+     if(f&&(shards>0)&&(shard>=1)&&(shard<=shards))
+      {
+       long long size=file_size(f);
+       rangestart=size*(shard-1)/shards;
+       rangeend=(shard<shards)?size*shard/shards:0;
+      }
+     else
+      printf("bad -shard param (%s) or missing corpus\n",value);
+     if(f) fclose(f);
+    }
+   if(getparam("-checkpoint",argc,argv,value))
+    checkpointevery=max(1,atoi(value));
+   if(getparam("-resume",argc,argv,NULL))
+    resume=1;
+   if(getparam("-checkpointfile",argc,argv,value))
+    strcpy(checkpoint,value);
+   else
+   if(checkpointevery||resume)
+    {strcpy(checkpoint,neighbors);setextension(checkpoint,"ckpt");}
    
    printf("Word2Neighborhood\n");
    switch(mode)
     {
      case 1:
-      createdictionary(corpus,dict,stopwords,filter|(conllufilter<<16),fileformat|(format<<8),maxdocs,flags,emit,sortway);
+      createdictionary(corpus,dict,stopwords,filter|(conllufilter<<16),fileformat|(format<<8),maxdocs,flags,emit,sortway,stats,rangestart,rangeend);
      break;
      case 2:
-      createneighbors(corpus,dict,stopwords,neighbors,width,area,filter|(conllufilter<<16),fileformat|(format<<8),maxdocs,flags);
+      createneighbors(corpus,dict,stopwords,neighbors,width,area,filter|(conllufilter<<16),fileformat|(format<<8),maxdocs,flags,sample,seed,stats,checkpoint,checkpointevery,resume,rangestart,rangeend);
+     break;
+     case 8:
+      updatecorpus(corpus,dict,stopwords,neighbors,width,filter|(conllufilter<<16),fileformat|(format<<8),maxdocs,flags,emit,sortway,stats);
+     break;
+     case 9:
+      {
+       // -merge dict1 neighbors1 dict2 neighbors2 ... / -mergedicts dict1 dict2 ...
+       const char*mdicts[256],*mneighbors[256];
+       int        i,n=0,dictsonly=0;
+       for(i=1;i<argc;i++)
+        if(strcmp(argv[i],"-merge")==0)
+         break;
+        else
+        if(strcmp(argv[i],"-mergedicts")==0)
+         {dictsonly=1;break;}
+       for(i++;(i+1-dictsonly<argc)&&(*argv[i]!='-')&&(dictsonly||(*argv[i+1]!='-'))&&(n<256);i+=2-dictsonly)
+        {mdicts[n]=argv[i];mneighbors[n++]=dictsonly?NULL:argv[i+1];}
+       if(n)
+        mergefiles(mdicts,dictsonly?NULL:mneighbors,n,dict,neighbors,getparam("-mergecut",argc,argv,NULL),flags,emit,sortway);
+       else
+        printf("missing -merge files (dictionary neighborhood couples)\n");
+      }
      break;
      case 3:
-      queryneighbors(dict,neighbors,area);
+      queryneighbors(dict,neighbors,vectors,quantized,similar,area,metric,rerank,getparam("-topk",argc,argv,NULL)?topk:0,flags);
+     break;
+     case 5:
+      createembeddings(dict,neighbors,vectors,dim,threads);
+     break;
+     case 6:
+      createquantized(vectors,quantized);
+     break;
+     case 10:
+      createsimilar(dict,neighbors,similar,max(1,area),topk,metric,threads);
+     break;
+#if defined(W2N_BENCHMARK)
+     case 7:
+      {
+       int scale=1;
+       if(getparam("-benchsize",argc,argv,value))
+        scale=max(1,atoi(value));
+       if(!getparam("-benchout",argc,argv,value))
+        strcpy(value,"bench.json");
+       benchmark(value,scale);
+      }
+     break;
+#endif
+     case 4:
+      {
+       int errs=rowkernel_selftest(2000);
+       printf("row kernels selftest: %s (%d mismatches)\n",errs?"FAILED":"ok",errs);
+      }
      break;
     }       
   }   
  return 1;
-}
\ No newline at end of file
+}
+
+#endif
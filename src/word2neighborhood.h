@@ -0,0 +1,94 @@
+//
+//  Copyright 2017 Marco Giorgini All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+//  -----------------------------------------------------------------------
+//  Word2Neighborhood library API
+//  compile word2neighborhood.c with -DW2N_LIBRARY to leave main() out
+//
+//  a model is a dictionary + binary neighborhood couple (plus an optional
+//  similar file), opened read only: once w2n_open returns, any number of
+//  threads can query it at the same time. Query functions never print,
+//  never read files and never change the model
+//  -----------------------------------------------------------------------
+
+#if !defined(WORD2NEIGHBORHOOD_H)
+#define WORD2NEIGHBORHOOD_H
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// row similarities (see -metric)
+#define W2N_METRIC_DISTANCE   0 // weighted euclidean, lower is better
+#define W2N_METRIC_SHARE      1
+#define W2N_METRIC_COSINE     2
+#define W2N_METRIC_JACCARD    3
+#define W2N_METRIC_PPMICOSINE 4
+
+// w2n_open flags
+#define W2N_PACKDICT 4 // front coded dictionary strings when smaller (see -packdict)
+
+// w2n_open errors
+#define W2N_OK             0
+#define W2N_ERR_MEMORY     1
+#define W2N_ERR_DICTIONARY 2
+#define W2N_ERR_NEIGHBORS  3
+#define W2N_ERR_METRIC     4
+#define W2N_ERR_SIMILAR    5
+#define W2N_ERR_MISMATCH   6 // similar file built for another dictionary, metric or area
+
+typedef struct w2n_model w2n_model;
+
+typedef struct {
+ int   id;
+ float score;
+}w2n_result;
+
+// area: max row items used by metrics and show (the -area of the CLI);
+// neighbors NULL or "" opens the dictionary only: w2n_similar then needs
+// a similar file, w2n_row, w2n_score and w2n_show find nothing
+w2n_model *w2n_open(const char*dictionary,const char*neighbors,int area,int metric,int flags,int*err);
+// adds a similar file (-create similar) built for the same dictionary,
+// metric and area (W2N_ERR_MISMATCH otherwise, and w2n_similar scans
+// rows); w2n_similar then reads from it - not to be called while querying
+int        w2n_opensimilar(w2n_model*m,const char*similar);
+void       w2n_close(w2n_model*m);
+
+// dictionary
+int        w2n_size(const w2n_model*m);
+int        w2n_lookup(const w2n_model*m,const char*word);             // id, -1 if missing
+int        w2n_word(const w2n_model*m,int id,char*out,int outsize);    // 0 if id is out of range or out too short
+
+// neighborhood row of id: id/count couples in stored order (the first
+// area ones are the row metrics use), returns the number of couples;
+// counts of a -DW2N_WIDE build are capped at INT_MAX
+int        w2n_row(const w2n_model*m,int id,int*row,int maxitems);
+
+// best k words for id, with the model metric: results are best first, id
+// -1 past the last one; returns the number of results, -1 if out of memory
+int        w2n_similar(const w2n_model*m,int id,w2n_result*out,int k);
+// score of b against a, 0 if b has no row
+int        w2n_score(const w2n_model*m,int a,int b,float*score);
+
+// words in the rows of all ids, by summed count (score): out holds k
+// results, or area ones if k<=0; returns the number of results, -1 if
+// out of memory
+int        w2n_show(const w2n_model*m,const int*ids,int n,w2n_result*out,int k);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif